@@ -274,6 +274,8 @@ ikcpcb *ikcp_create(IUINT32 conv, void *user) {
   kcp->dead_link  = IKCP_DEADLINK;
   kcp->output     = NULL;
   kcp->writelog   = NULL;
+  kcp->open       = NULL;
+  kcp->open_cap   = 0;
 
   return kcp;
 }
@@ -305,6 +307,10 @@ void ikcp_release(ikcpcb *kcp) {
       iqueue_del(&seg->node);
       ikcp_segment_delete(kcp, seg);
     }
+    if (kcp->open) {
+      ikcp_segment_delete(kcp, kcp->open);
+      kcp->open = NULL;
+    }
     if (kcp->buffer) {
       ikcp_free(kcp->buffer);
     }
@@ -330,6 +336,32 @@ void ikcp_setoutput(ikcpcb *kcp, int (*output)(const char *buf, int len, ikcpcb
   kcp->output = output;
 }
 
+//---------------------------------------------------------------------
+// move available data from rcv_buf -> rcv_queue after the user read
+//---------------------------------------------------------------------
+static void ikcp_refill(ikcpcb *kcp, int recover) {
+  IKCPSEG *seg;
+  while (!iqueue_is_empty(&kcp->rcv_buf)) {
+    seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
+    if (seg->sn == kcp->rcv_nxt && kcp->nrcv_que < kcp->rcv_wnd) {
+      iqueue_del(&seg->node);
+      kcp->nrcv_buf--;
+      iqueue_add_tail(&seg->node, &kcp->rcv_queue);
+      kcp->nrcv_que++;
+      kcp->rcv_nxt++;
+    } else {
+      break;
+    }
+  }
+
+  // fast recover
+  if (kcp->nrcv_que < kcp->rcv_wnd && recover) {
+    // ready to send back IKCP_CMD_WINS in ikcp_flush
+    // tell remote my window size
+    kcp->probe |= IKCP_ASK_TELL;
+  }
+}
+
 //---------------------------------------------------------------------
 // user/upper level recv: returns size, returns below zero for EAGAIN
 //---------------------------------------------------------------------
@@ -388,28 +420,38 @@ int ikcp_recv(ikcpcb *kcp, char *buffer, int len) {
 
   assert(len == peeksize);
 
-  // move available data from rcv_buf -> rcv_queue
-  while (!iqueue_is_empty(&kcp->rcv_buf)) {
-    seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
-    if (seg->sn == kcp->rcv_nxt && kcp->nrcv_que < kcp->rcv_wnd) {
-      iqueue_del(&seg->node);
-      kcp->nrcv_buf--;
-      iqueue_add_tail(&seg->node, &kcp->rcv_queue);
-      kcp->nrcv_que++;
-      kcp->rcv_nxt++;
-    } else {
-      break;
-    }
-  }
+  ikcp_refill(kcp, recover);
 
-  // fast recover
-  if (kcp->nrcv_que < kcp->rcv_wnd && recover) {
-    // ready to send back IKCP_CMD_WINS in ikcp_flush
-    // tell remote my window size
-    kcp->probe |= IKCP_ASK_TELL;
+  return len;
+}
+
+//---------------------------------------------------------------------
+// zero copy recv
+//---------------------------------------------------------------------
+int ikcp_peek(ikcpcb *kcp, char **data, int *len, int count) {
+  struct IQUEUEHEAD *p;
+  int                n = 0;
+  for (p = kcp->rcv_queue.next; p != &kcp->rcv_queue && n < count; p = p->next, n++) {
+    IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+    data[n]      = seg->data;
+    len[n]       = (int)seg->len;
   }
+  return n;
+}
 
-  return len;
+void ikcp_consume(ikcpcb *kcp, int count) {
+  IKCPSEG *seg;
+  int      recover = (kcp->nrcv_que >= kcp->rcv_wnd) ? 1 : 0;
+  while (count-- > 0 && !iqueue_is_empty(&kcp->rcv_queue)) {
+    seg = iqueue_entry(kcp->rcv_queue.next, IKCPSEG, node);
+    if (ikcp_canlog(kcp, IKCP_LOG_RECV)) {
+      ikcp_log(kcp, IKCP_LOG_RECV, "recv sn=%lu", (unsigned long)seg->sn);
+    }
+    iqueue_del(&seg->node);
+    ikcp_segment_delete(kcp, seg);
+    kcp->nrcv_que--;
+  }
+  ikcp_refill(kcp, recover);
 }
 
 //---------------------------------------------------------------------
@@ -442,6 +484,117 @@ int ikcp_peeksize(const ikcpcb *kcp) {
   return length;
 }
 
+//---------------------------------------------------------------------
+// zero copy send
+//---------------------------------------------------------------------
+char *ikcp_reserve(ikcpcb *kcp, int *room) {
+  IKCPSEG *seg = kcp->open;
+  IUINT32  cap;
+  if (seg == NULL) {
+    seg = ikcp_segment_new(kcp, kcp->mss);
+    assert(seg);
+    if (seg == NULL) {
+      *room = 0;
+      return NULL;
+    }
+    seg->len      = 0;
+    kcp->open     = seg;
+    kcp->open_cap = kcp->mss;
+  }
+  cap   = _imin_(kcp->open_cap, kcp->mss);
+  *room = seg->len < cap ? (int)(cap - seg->len) : 0;
+  return seg->data + seg->len;
+}
+
+void ikcp_commit(ikcpcb *kcp, int len) {
+  assert(kcp->open);
+  assert(len >= 0 && kcp->open->len + len <= kcp->open_cap);
+  kcp->open->len += len;
+}
+
+// replace a queued segment longer than mss by segments of at most mss bytes,
+// the bytes read as a stream with ikcp_peek are the same. a message sent in
+// fragments keeps its segments, so does any segment when out of memory.
+static void ikcp_split(ikcpcb *kcp, IKCPSEG *seg, IUINT32 mss) {
+  struct IQUEUEHEAD pieces;
+  IUINT32           offset;
+  int               count = 0;
+  if (mss == 0 || seg->len <= mss || seg->frg != 0) {
+    return;
+  }
+  iqueue_init(&pieces);
+  for (offset = 0; offset < seg->len; offset += mss) {
+    IUINT32  size  = _imin_(seg->len - offset, mss);
+    IKCPSEG *piece = ikcp_segment_new(kcp, (int)size);
+    if (piece == NULL) {
+      while (!iqueue_is_empty(&pieces)) {
+        piece = iqueue_entry(pieces.next, IKCPSEG, node);
+        iqueue_del(&piece->node);
+        ikcp_segment_delete(kcp, piece);
+      }
+      return;
+    }
+    memcpy(piece->data, seg->data + offset, size);
+    piece->len = size;
+    piece->frg = 0;
+    iqueue_add_tail(&piece->node, &pieces);
+    count++;
+  }
+  iqueue_splice(&pieces, &seg->node);
+  iqueue_del(&seg->node);
+  ikcp_segment_delete(kcp, seg);
+  kcp->nsnd_que += count - 1;
+}
+
+int ikcp_push(ikcpcb *kcp) {
+  IKCPSEG *seg = kcp->open;
+  int      len;
+  if (seg == NULL || seg->len == 0) {
+    return 0;
+  }
+  len = (int)seg->len;
+  // append to previous segment in streaming mode (if possible)
+  if (kcp->stream != 0 && !iqueue_is_empty(&kcp->snd_queue)) {
+    IKCPSEG *old = iqueue_entry(kcp->snd_queue.prev, IKCPSEG, node);
+    if (old->len < kcp->mss && old->frg == 0) {
+      IUINT32  extend = _imin_(kcp->mss - old->len, seg->len);
+      IKCPSEG *merged = ikcp_segment_new(kcp, (int)(old->len + extend));
+      if (merged != NULL) {
+        memcpy(merged->data, old->data, old->len);
+        memcpy(merged->data + old->len, seg->data, extend);
+        merged->len = old->len + extend;
+        merged->frg = 0;
+        iqueue_add(&merged->node, &old->node);
+        iqueue_del(&old->node);
+        ikcp_segment_delete(kcp, old);
+        seg->len -= extend;
+        if (seg->len == 0) {
+          kcp->open = NULL;
+          ikcp_segment_delete(kcp, seg);
+          return len;
+        }
+        memmove(seg->data, seg->data + extend, seg->len);
+      }
+    }
+  }
+  seg->frg  = 0;
+  kcp->open = NULL;
+  iqueue_init(&seg->node);
+  iqueue_add_tail(&seg->node, &kcp->snd_queue);
+  kcp->nsnd_que++;
+  // filled before the mtu shrank
+  ikcp_split(kcp, seg, kcp->mss);
+  return len;
+}
+
+int ikcp_pending(const ikcpcb *kcp) {
+  return kcp->open ? (int)kcp->open->len : 0;
+}
+
+void ikcp_probe(ikcpcb *kcp) {
+  kcp->probe |= IKCP_ASK_SEND;
+}
+
 //---------------------------------------------------------------------
 // user/upper level send, returns below zero for error
 //---------------------------------------------------------------------
@@ -1182,10 +1335,24 @@ IUINT32 ikcp_check(const ikcpcb *kcp, IUINT32 current) {
 }
 
 int ikcp_setmtu(ikcpcb *kcp, int mtu) {
-  char *buffer;
+  struct IQUEUEHEAD *p, *next;
+  IUINT32            largest = 0;
+  char *             buffer;
   if (mtu < (int)IKCP_OVERHEAD)
     return -1;
-  buffer = (char *)ikcp_malloc((mtu + IKCP_OVERHEAD) * 3);
+  // segments waiting for the window are cut to the new mss, the ones sent
+  // already keep their sn and size, ikcp_flush must still fit them
+  for (p = kcp->snd_queue.next; p != &kcp->snd_queue; p = next) {
+    next = p->next;
+    ikcp_split(kcp, iqueue_entry(p, IKCPSEG, node), mtu - IKCP_OVERHEAD);
+  }
+  for (p = kcp->snd_queue.next; p != &kcp->snd_queue; p = p->next) {
+    largest = _imax_(largest, iqueue_entry(p, IKCPSEG, node)->len);
+  }
+  for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next) {
+    largest = _imax_(largest, iqueue_entry(p, IKCPSEG, node)->len);
+  }
+  buffer = (char *)ikcp_malloc(_imax_((mtu + IKCP_OVERHEAD) * 3, largest + IKCP_OVERHEAD));
   if (buffer == NULL)
     return -2;
   kcp->mtu = mtu;
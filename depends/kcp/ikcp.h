@@ -309,6 +309,8 @@ struct IKCPCB {
   int               fastlimit;
   int               nocwnd, stream;
   int               logmask;
+  struct IKCPSEG *  open;  // segment being filled in place, see ikcp_reserve
+  IUINT32           open_cap;
   int (*output)(const char *buf, int len, struct IKCPCB *kcp, void *user);
   void (*writelog)(const char *log, struct IKCPCB *kcp, void *user);
 };
@@ -353,6 +355,35 @@ int ikcp_recv(ikcpcb *kcp, char *buffer, int len);
 // user/upper level send, returns below zero for error
 int ikcp_send(ikcpcb *kcp, const char *buffer, int len);
 
+// zero copy recv: points data[i] and len[i] at the payload of up to count
+// segments at the head of the receive queue, in order, returns how many.
+// message boundaries are not reassembled, the payload stays valid until
+// it is released by ikcp_consume.
+int ikcp_peek(ikcpcb *kcp, char **data, int *len, int count);
+
+// release the first count segments of the receive queue
+void ikcp_consume(ikcpcb *kcp, int count);
+
+// zero copy send: returns where up to *room bytes may be written in place,
+// at the end of the open segment which holds at most one mss. the bytes
+// are accounted by ikcp_commit and queued for sending by ikcp_push.
+char *ikcp_reserve(ikcpcb *kcp, int *room);
+
+// account len bytes written at the pointer returned by ikcp_reserve
+void ikcp_commit(ikcpcb *kcp, int len);
+
+// move the open segment to the send queue as a message, returns its size.
+// in stream mode the bytes first fill up the last queued segment, a segment
+// filled before the mtu shrank goes in pieces of one mss.
+int ikcp_push(ikcpcb *kcp);
+
+// bytes in the open segment, not queued yet
+int ikcp_pending(const ikcpcb *kcp);
+
+// ask the peer for its window at the next flush, a bare segment which is
+// answered right away and never retransmitted, usable as a keepalive
+void ikcp_probe(ikcpcb *kcp);
+
 // update state (call it repeatedly, every 10ms-100ms), or you can ask
 // ikcp_check when to call it again (without ikcp_input/_send calling).
 // 'current' - current timestamp in millisec.
@@ -376,7 +407,8 @@ void ikcp_flush(ikcpcb *kcp);
 // check the size of next message in the recv queue
 int ikcp_peeksize(const ikcpcb *kcp);
 
-// change MTU size, default is 1400
+// change MTU size, default is 1400. queued segments larger than the new mss
+// are split, segments in flight are retransmitted at the size they were sent.
 int ikcp_setmtu(ikcpcb *kcp, int mtu);
 
 // set maximum window size: sndwnd=32, rcvwnd=32 by default
@@ -22,15 +22,23 @@
 
 #include "Acceptor.h"
 #include "timeUtility.h"
+#include "stats.h"
 #include <cerrno>
+#include <climits>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/ioctl.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 
-std::set<Channel *> Channel::channels_;
-unsigned char *     Channel::recv_buffer_ = new unsigned char[SIZE_4M];
+thread_local slot_map<Channel *>    Channel::channels_;
+thread_local std::vector<Channel *> Channel::gathered_;
+thread_local std::vector<Channel *> Channel::reclaim_;
+thread_local Reactor::PrepareHandle Channel::reclaim_hook_ = 0;
+thread_local unsigned char *Channel::recv_buffer_ = new unsigned char[SIZE_4M];
+
+constexpr int Channel::READ_BUDGET;
 
 Acceptor::Acceptor(Reactor *reactor)
   : listenFd_(0)
@@ -59,7 +67,7 @@ Acceptor::~Acceptor() {
   }
 }
 
-int Acceptor::listen(int port) {
+int Acceptor::listen(int port, int backlog, bool reuse_port, bool fast_open, bool transparent) {
   struct sockaddr_in me {};
   listenFd_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
   if (listenFd_ < 0) {
@@ -67,6 +75,33 @@ int Acceptor::listen(int port) {
   }
   int on = 1;
   setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on));
+  if (reuse_port) {
+#ifdef SO_REUSEPORT
+    setsockopt(listenFd_, SOL_SOCKET, SO_REUSEPORT, (char *)&on, sizeof(on));
+#else
+    LOG_WARN << "SO_REUSEPORT is not supported";
+#endif
+  }
+  if (fast_open) {
+#ifdef TCP_FASTOPEN
+    if (setsockopt(listenFd_, IPPROTO_TCP, TCP_FASTOPEN, &backlog, sizeof(backlog)) < 0) {
+      LOG_WARN << "TCP_FASTOPEN failed, errno = " << errno;
+    }
+#else
+    LOG_WARN << "TCP_FASTOPEN is not supported";
+#endif
+  }
+  if (transparent) {
+#ifdef IP_TRANSPARENT
+    if (setsockopt(listenFd_, IPPROTO_IP, IP_TRANSPARENT, &on, sizeof(on)) < 0) {
+      // Needs CAP_NET_ADMIN, REDIRECT works without it
+      LOG_WARN << "IP_TRANSPARENT failed, errno = " << errno;
+    }
+#else
+    LOG_WARN << "IP_TRANSPARENT is not supported";
+#endif
+  }
+  fcntl(listenFd_, F_SETFD, FD_CLOEXEC);
   memset(&me, 0, sizeof(me));
   me.sin_family = AF_INET;
   me.sin_port   = htons(port);
@@ -85,9 +120,10 @@ int Acceptor::listen(int port) {
     }
     break;
   }
-  if (::listen(listenFd_, 5) < 0) {
+  if (::listen(listenFd_, backlog) < 0) {
     printf("Acceptor can not listen");
   }
+  LOG_INFO << "listen on port " << port << ", backlog " << backlog;
   Reactor::Callback cb = std::bind(&Acceptor::accept, this);
   reactor_->RegisterIO(cb, listenFd_);
   return 0;
@@ -101,13 +137,38 @@ int Acceptor::start() {
 }
 
 int Acceptor::accept() {
-  struct sockaddr_in it {};
-  socklen_t          nameLen   = sizeof(it);
-  auto               channelFd = ::accept(listenFd_, (struct sockaddr *)&it, &nameLen);
-
-  auto *channel = new Channel(reactor_, channelFd, -1);
-  on_connect(channel);
-
+  // Drain the whole queue, a storm of connections is signalled by one readiness event
+  uint64_t accepted = 0;
+  while (true) {
+    struct sockaddr_in it {};
+    socklen_t          nameLen = sizeof(it);
+#if defined(__linux__)
+    int flags     = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    int channelFd = ::accept4(listenFd_, (struct sockaddr *)&it, &nameLen, flags);
+#else
+    int channelFd = ::accept(listenFd_, (struct sockaddr *)&it, &nameLen);
+    if (channelFd >= 0) {
+      fcntl(channelFd, F_SETFL, fcntl(channelFd, F_GETFL, 0) | O_NONBLOCK);
+      fcntl(channelFd, F_SETFD, FD_CLOEXEC);
+    }
+#endif
+    if (channelFd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        // Out of fds or buffers, the rest stays queued until the next event
+        LOG_WARN << "accept failed, errno = " << errno;
+        stats::add(stats::ACCEPT_ERRORS);
+      }
+      break;
+    }
+    ++accepted;
+    auto *channel = new Channel(reactor_, channelFd, -1);
+    on_connect(channel);
+  }
+  stats::add(stats::ACCEPTED, accepted);
+  stats::max(stats::ACCEPT_BATCH_MAX, accepted);
   return 0;
 }
 
@@ -139,29 +200,50 @@ int socket_output(const char *buf, int size, ikcpcb *kcp, void *fd) {
   return ::write(*(int *)fd, buf, size);
 }
 
-Channel::Channel(Reactor *reactor, int fd, int kcpConv)
+Channel::Channel(Reactor *reactor, int fd, int kcpConv, bool fast_open)
   : reactor_(reactor)
   , fd_(fd)
   , read_cb_(nullptr)
+  , reserve_cb_(nullptr)
+  , commit_cb_(nullptr)
   , disconnect_cb_(nullptr)
+  , eof_cb_(nullptr)
   , kcpConv_(kcpConv)
   , kcp_(nullptr)
   , bytes_write_(0)
   , bytes_read_(0)
   , connected_(false)
-  , reconnect_count_(0) {
+  , reconnect_count_(0)
+  , fast_open_(fast_open)
+  , read_closed_(false)
+  , write_closed_(false)
+  , closed_(false)
+  , last_active_(now_ms()) {
   LOG_INFO << "fd:" << fd_ << " create new channel";
 
   send_buffer_.reserve(SIZE_1M);
-  channels_.insert(this);
+  handle_ = channels_.insert(this);
+  if (reclaim_hook_ == 0) {
+    Reactor::Callback reclaimCb = &Channel::reclaim;
+    reclaim_hook_               = reactor_->RegisterPrepare(reclaimCb);
+  }
 
-  Reactor::Callback cb = std::bind(&Channel::read, this, std::placeholders::_1);
-  reactor_->RegisterIO(cb, fd_);
+  read_watcher_.handler  = Reactor::Handler::of<Channel, &Channel::read>(this);
+  connect_timer_.handler = Reactor::Handler::of<Channel, &Channel::on_connect_timer>(this);
+  reactor_->StartIO(read_watcher_, fd_);
 
   on_connect(kcpConv);
 }
 
 int Channel::on_connect(int kcpConv) {
+  if (closed_) {
+    return 0;
+  }
+  if (fast_open_) {
+    // Nothing is on the wire yet, give the peer a moment to hand over the first payload
+    reactor_->StartTimer(connect_timer_, FAST_OPEN_WAIT);
+    return 0;
+  }
   struct timeval tval {};
   fd_set         wset;
   FD_ZERO(&wset);
@@ -174,18 +256,23 @@ int Channel::on_connect(int kcpConv) {
   }
   if (!FD_ISSET(fd_, &wset)) {
     if (++reconnect_count_ > 10) {
-      reactor_->RemoveTimer(1000 + fd_);
+      reactor_->StopTimer(connect_timer_);
       on_disconnect();
       return -1;
     }
-    Reactor::Callback cb = std::bind(&Channel::on_connect, this, kcpConv);
-    reactor_->RegisterTimer(cb, 1000 + fd_, 0, 0.1);
+    reactor_->StartTimer(connect_timer_, 0.1);
     return 0;
   }
-  LOG_INFO << "fd[" << fd_ << "] connected to the server success";
-  if (reconnect_count_ > 0) {
-    reactor_->RemoveTimer(1000 + fd_);
+  reactor_->StopTimer(connect_timer_);
+  int       so_error = 0;
+  socklen_t len      = sizeof(so_error);
+  getsockopt(fd_, SOL_SOCKET, SO_ERROR, &so_error, &len);
+  if (so_error != 0) {
+    LOG_INFO << "fd[" << fd_ << "] connect failed, errno = " << so_error;
+    on_disconnect();
+    return -1;
   }
+  LOG_INFO << "fd[" << fd_ << "] connected to the server success";
   int flags = fcntl(fd_, F_GETFL, 0);
   flags     = ~O_NONBLOCK & flags;
   fcntl(fd_, F_SETFL, flags);
@@ -193,12 +280,42 @@ int Channel::on_connect(int kcpConv) {
   connected_ = true;
 
   if (!send_buffer_.empty()) {
-    write(send_buffer_.data(), send_buffer_.size());
+    // Also after a half close while connecting, it only waited for the buffered data
+    transmit(send_buffer_.data(), send_buffer_.size());
     send_buffer_.clear();
   }
+  if (write_closed_) {
+    ::shutdown(fd_, SHUT_WR);
+  }
   return 0;
 }
 
+int Channel::on_connect_timer(int evId) {
+  return fast_open_ ? fast_open(evId) : on_connect(kcpConv_);
+}
+
+int Channel::fast_open(int evId) {
+  if (closed_) {
+    return 0;
+  }
+  fast_open_ = false;
+  // The buffered payload rides on the SYN, an empty send still starts the handshake
+  ssize_t ret = ::send(fd_, send_buffer_.data(), send_buffer_.size(), MSG_DONTWAIT);
+  if (ret < 0 && errno != EINPROGRESS && errno != EAGAIN) {
+    LOG_INFO << "fd[" << fd_ << "] fast open failed, errno = " << errno;
+    on_disconnect();
+    return -1;
+  }
+  if (ret > 0) {
+    LOG_INFO << "fd[" << fd_ << "] " << ret << " bytes sent with the SYN";
+    bytes_write_ += ret;
+    send_buffer_.erase(send_buffer_.begin(), send_buffer_.begin() + ret);
+    stats::add(stats::FAST_OPEN_BYTES, ret);
+  }
+  stats::add(stats::FAST_OPENS);
+  return on_connect(kcpConv_);
+}
+
 void writelog(const char *log, struct IKCPCB *kcp, void *user) {
   LOG_INFO << kcp->conv << "," << log;
 }
@@ -211,41 +328,122 @@ void Channel::init_kcp(int conv) {
   kcp_->logmask           = 15;
   kcp_->writelog          = writelog;
   ikcp_nodelay(kcp_, 1, 1, 2, 1);
-  reactor_->RegisterTimer(kcpCb, 19890, 10);
+  kcp_timer_ = reactor_->RegisterTimer(kcpCb, 10);
 }
 
 int Channel::read(int fd) {
-  while (connected_) {
-    ssize_t ret = ::read(fd_, recv_buffer_, BUF_SIZE);
-    if (ret <= 0) {
+  if (!connected_ && !closed_ && !fast_open_) {
+    // The peer answered before the next connect probe, e.g. right after the SYN-ACK
+    reactor_->StopTimer(connect_timer_);
+    on_connect(kcpConv_);
+  }
+  if (!connected_) {
+    return 0;
+  }
+  int   room     = 0;
+  auto *reserved = reserve_cb_ ? (*reserve_cb_)(&room) : nullptr;
+  if (reserved == nullptr) {
+    room = 0;
+  }
+  room = std::min(room, READ_BUDGET);
+  // Fill the reserved room first, whatever does not fit goes through recv_buffer_
+  struct iovec iov[2];
+  iov[0].iov_base = reserved;
+  iov[0].iov_len  = room;
+  iov[1].iov_base = recv_buffer_;
+  iov[1].iov_len  = READ_BUDGET - room;
+
+  // One read per callback, the watcher is level triggered so whatever the budget leaves behind
+  // brings us back on the next loop iteration, after the other sockets and the timers
+  struct msghdr msg {};
+  msg.msg_iov    = reserved ? iov : iov + 1;
+  msg.msg_iovlen = reserved ? 2 : 1;
+  // Connected upstreams block on writes, a read must never wait
+  ssize_t ret     = ::recvmsg(fd_, &msg, MSG_DONTWAIT);
+  int     inplace = ret > 0 ? (int)std::min<ssize_t>(ret, room) : 0;
+  if (reserved) {
+    bytes_read_ += inplace;
+    last_active_ = now_ms();
+    (*commit_cb_)(reserved, inplace);
+  }
+  if (ret == 0) {
+    on_eof();
+  } else if (ret < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
       on_disconnect();
-      break;
-    } else if (ret < BUF_SIZE) {
-      on_read(recv_buffer_, ret);
-      break;
-    } else if (ret == BUF_SIZE) {
-      on_read(recv_buffer_, ret);
     }
+  } else if (ret > inplace) {
+    on_read(recv_buffer_, ret - inplace);
   }
   return 0;
 }
 
-int check_connections(int flag, Channel *channel) {
-  if (channel && !channel->connected_) {
+int Channel::reclaim(int evId) {
+  if (reclaim_.empty()) {
+    return 0;
+  }
+  std::vector<Channel *> closed;
+  closed.swap(reclaim_);
+  for (auto *channel : closed) {
     LOG_INFO << "Channel[fd=" << channel->fd() << "] disconnected";
     delete channel;
   }
   return 0;
 }
 
+int Channel::on_eof() {
+  if (!eof_cb_) {
+    return on_disconnect();
+  }
+  LOG_INFO << "fd:" << fd_ << " read closed";
+  read_closed_ = true;
+  reactor_->StopIO(read_watcher_);
+  (*eof_cb_)(this);
+  if (write_closed_) {
+    on_disconnect();
+  }
+  return 0;
+}
+
+void Channel::shutdown() {
+  if (write_closed_ || closed_) {
+    return;
+  }
+  LOG_INFO << "fd:" << fd_ << " write closed";
+  flush(false);
+  write_closed_ = true;
+  if (connected_) {
+    ::shutdown(fd_, SHUT_WR);
+  }
+  if (read_closed_) {
+    on_disconnect();
+  }
+}
+
+void Channel::reset() {
+  if (closed_) {
+    return;
+  }
+  struct linger lin {
+    1, 0
+  };
+  setsockopt(fd_, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+  on_disconnect();
+}
+
 int Channel::on_disconnect() {
+  if (closed_) {
+    return 0;
+  }
+  closed_ = true;
   LOG_INFO << "fd:" << fd_ << " disconnected";
+  reactor_->StopIO(read_watcher_);
+  channels_.erase(handle_);
   if (disconnect_cb_) {
     (*disconnect_cb_)(this);
   }
-  connected_                = false;
-  Reactor::Callback checkCb = std::bind(&check_connections, std::placeholders::_1, this);
-  reactor_->RegisterTimer(checkCb, 2000 + fd_, 0, 0.01);
+  connected_ = false;
+  reclaim_.push_back(this);
   return 0;
 }
 
@@ -257,6 +455,21 @@ bool Channel::set_disconnect_callback(Channel::Callback &cb) {
   return true;
 }
 
+bool Channel::set_eof_callback(Channel::Callback &cb) {
+  if (!eof_cb_) {
+    eof_cb_ = new Callback(cb);
+  }
+  return true;
+}
+
+bool Channel::set_reserve_callback(Channel::ReserveCallbck &reserve, Channel::ReadCallbck &commit) {
+  if (!reserve_cb_) {
+    reserve_cb_ = new ReserveCallbck(reserve);
+    commit_cb_  = new ReadCallbck(commit);
+  }
+  return true;
+}
+
 bool Channel::set_read_callback(Channel::ReadCallbck &cb) {
   //  fprintf(stderr, "Channel::%s fd[%d]\n", __FUNCTION__, fd_);
   if (!read_cb_) {
@@ -267,6 +480,7 @@ bool Channel::set_read_callback(Channel::ReadCallbck &cb) {
 
 void Channel::on_read(unsigned char *buffer, int size) {
   LOG_INFO << "fd:" << fd() << " read " << size << " bytes";
+  last_active_ = now_ms();
   if (read_cb_) {
     if (kcp_ == nullptr) {
       bytes_read_ += size;
@@ -286,12 +500,24 @@ void Channel::on_read(unsigned char *buffer, int size) {
 }
 
 int Channel::write(unsigned char *buf, int size) {
+  if (write_closed_ || closed_) {
+    return 0;
+  }
+  if (!gather_.empty()) {
+    flush(false);
+  }
   if (!connected_) {
     LOG_INFO << "write but fd[" << fd_ << "] not connected, push to buffer";
     send_buffer_.insert(send_buffer_.end(), buf, buf + size);
     return 0;
   }
+  return transmit(buf, size);
+}
+
+// Sends on a connected channel, whether or not its write side is closed yet
+int Channel::transmit(unsigned char *buf, int size) {
   bytes_write_ += size;
+  last_active_ = now_ms();
   if (kcp_) {
     return ikcp_send(kcp_, (char *)buf, size);
   } else {
@@ -305,11 +531,12 @@ Channel::~Channel() {
   LOG_INFO << "destruct channel fd=" << fd_;
   if (kcp_) {
     LOG_INFO << "ikcp_release conv=" << kcp_->conv;
-    reactor_->RemoveTimer(19890);
+    reactor_->RemoveTimer(kcp_timer_);
     ikcp_release(kcp_);
   }
-  reactor_->RemoveIO(fd_);
-  channels_.erase(this);
+  reactor_->StopIO(read_watcher_);
+  reactor_->StopTimer(connect_timer_);
+  channels_.erase(handle_);
   ::close(fd_);
   if (read_cb_) {
     delete read_cb_;
@@ -319,6 +546,16 @@ Channel::~Channel() {
     delete disconnect_cb_;
     disconnect_cb_ = nullptr;
   }
+  if (eof_cb_) {
+    delete eof_cb_;
+    eof_cb_ = nullptr;
+  }
+  if (reserve_cb_) {
+    delete reserve_cb_;
+    delete commit_cb_;
+    reserve_cb_ = nullptr;
+    commit_cb_  = nullptr;
+  }
 }
 
 int Channel::update_kcp(int elapse) {
@@ -328,9 +565,91 @@ int Channel::update_kcp(int elapse) {
   return 0;
 }
 
-int Channel::write(Channel *channel, unsigned char *buf, int size) {
-  if (channels_.find(channel) == channels_.end()) {
+Channel *Channel::get(Channel::Handle handle) {
+  auto *channel = channels_.get(handle);
+  return channel ? *channel : nullptr;
+}
+
+int Channel::write(Channel::Handle handle, unsigned char *buf, int size) {
+  auto *channel = get(handle);
+  return channel ? channel->write(buf, size) : 0;
+}
+
+int Channel::gather(Channel::Handle handle, unsigned char *buf, int size) {
+  auto *channel = get(handle);
+  return channel ? channel->gather(buf, size) : 0;
+}
+
+int Channel::gather(unsigned char *buf, int size) {
+  if (write_closed_ || closed_) {
+    return 0;
+  }
+  if (!connected_ || kcp_) {
+    // Has to be copied anyway
+    return write(buf, size);
+  }
+  if (gather_.size() >= IOV_MAX) {
+    flush(true);
+  }
+  if (gather_.empty()) {
+    gathered_.push_back(this);
+  }
+  struct iovec iov;
+  iov.iov_base = buf;
+  iov.iov_len  = size;
+  gather_.push_back(iov);
+  return size;
+}
+
+int Channel::flush(bool more) {
+  if (gather_.empty()) {
     return 0;
   }
-  return channel->write(buf, size);
+  if (write_closed_ || closed_) {
+    gather_.clear();
+    return 0;
+  }
+  struct msghdr msg {};
+  msg.msg_iov    = gather_.data();
+  msg.msg_iovlen = gather_.size();
+  int flags      = 0;
+#ifdef MSG_MORE
+  flags |= more ? MSG_MORE : 0;
+#endif
+  ssize_t total = 0;
+  while (msg.msg_iovlen > 0) {
+    ssize_t ret = ::sendmsg(fd_, &msg, flags);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG_WARN << "fd:" << fd_ << " writev failed, errno = " << errno;
+      break;
+    }
+    total += ret;
+    // Skip what went out, the socket is blocking so this only happens on signals
+    while (msg.msg_iovlen > 0 && (size_t)ret >= msg.msg_iov->iov_len) {
+      ret -= msg.msg_iov->iov_len;
+      msg.msg_iov++;
+      msg.msg_iovlen--;
+    }
+    if (msg.msg_iovlen > 0) {
+      msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + ret;
+      msg.msg_iov->iov_len -= ret;
+    }
+  }
+  LOG_DBUG << "fd:" << fd_ << " writev " << gather_.size() << " pieces, " << total << " bytes";
+  bytes_write_ += total;
+  last_active_ = now_ms();
+  gather_.clear();
+  return (int)total;
+}
+
+void Channel::flush_gathered(bool more) {
+  // Channels are only deleted once per loop, the ones gathered in this batch are all alive
+  std::vector<Channel *> gathered;
+  gathered.swap(gathered_);
+  for (auto *channel : gathered) {
+    channel->flush(more);
+  }
 }
@@ -25,57 +25,118 @@
 
 #include "public.h"
 #include "Reactor.h"
+#include "slot_map.h"
 
 class Channel {
 public:
   using Callback                = std::function<int(Channel *)>;
   using ReadCallbck             = std::function<int(unsigned char *buffer, int size)>;
+  using ReserveCallbck          = std::function<unsigned char *(int *size)>;
+  using Handle                  = slot_map<Channel *>::handle;
   constexpr static int BUF_SIZE = SIZE_4M;
 
+  // Bytes one read callback takes at most, so a fast peer can not hold up the loop
+  constexpr static int READ_BUDGET = SIZE_1M / 4;
+  // Seconds a connect deferred by TCP fast open waits for a payload to carry on the SYN
+  constexpr static double FAST_OPEN_WAIT = 0.002;
+
 public:
-  Channel(Reactor *reactor, int fd, int kcpConv = -1);
+  // fast_open marks a connect deferred by TCP_FASTOPEN_CONNECT, see socket::create_tcp
+  Channel(Reactor *reactor, int fd, int kcpConv = -1, bool fast_open = false);
   virtual ~Channel();
 
-  int fd() const { return fd_; }
-
-  static int write(Channel *channel, unsigned char *buf, int size);
+  int      fd() const { return fd_; }
+  Handle   handle() const { return handle_; }
+  uint32_t last_active() const { return last_active_; }
+
+  // nullptr once the channel is closed, the object itself lives until the end of the loop
+  static Channel *get(Handle handle);
+  static int      write(Handle handle, unsigned char *buf, int size);
+  // Queues buf, which must stay valid until flush_gathered, to go out in one writev
+  static int gather(Handle handle, unsigned char *buf, int size);
+  // Writes what every channel gathered, more hints that another batch follows right away
+  static void flush_gathered(bool more);
   // Callbacks
   bool set_disconnect_callback(Callback &cb);
   bool set_read_callback(ReadCallbck &cb);
+  bool set_eof_callback(Callback &cb);
+  // Reads land in the room returned by reserve when there is one, commit hands it back filled
+  bool set_reserve_callback(ReserveCallbck &reserve, ReadCallbck &commit);
+
+  // The peer finished sending, close our write side once buffered data is out
+  void shutdown();
+  // Abortive close, the socket peer gets a RST
+  void reset();
+  bool closed_gracefully() const { return read_closed_ && write_closed_; }
 
   bool connected_;
 
 protected:
   virtual int  read(int fd);
   int          write(unsigned char *buf, int size);
+  int          transmit(unsigned char *buf, int size);
+  int          gather(unsigned char *buf, int size);
+  int          flush(bool more);
   virtual int  on_connect(int kcpConv);
+  int          on_connect_timer(int evId);
+  int          fast_open(int evId);
   virtual int  on_disconnect();
+  virtual int  on_eof();
   virtual void on_read(unsigned char *buffer, int size);
 
   void        init_kcp(int conv);
   virtual int update_kcp(int flag);
+  static int  reclaim(int evId);
 
 protected:
   Reactor *                  reactor_;
   Callback *                 disconnect_cb_;
+  Callback *                 eof_cb_;
   ReadCallbck *              read_cb_;
+  ReserveCallbck *           reserve_cb_;
+  ReadCallbck *              commit_cb_;
   int                        fd_;
   int                        kcpConv_;
   ikcpcb *                   kcp_;
+  Reactor::TimerHandle       kcp_timer_{0};
   size_t                     bytes_read_;
   size_t                     bytes_write_;
-  static std::set<Channel *> channels_;
-  static unsigned char *     recv_buffer_;
+  Handle                     handle_;
   std::vector<unsigned char> send_buffer_;
+  std::vector<struct iovec>  gather_;
   int                        reconnect_count_;
+  bool                       fast_open_;
+  bool                       read_closed_;
+  bool                       write_closed_;
+  bool                       closed_;
+  uint32_t                   last_active_;
+  Reactor::IOWatcher         read_watcher_;
+  Reactor::TimerWatcher      connect_timer_;  // Connect probes, or the fast open wait
+
+  // One of each per reactor thread
+  static thread_local slot_map<Channel *>    channels_;
+  static thread_local std::vector<Channel *> gathered_;
+  static thread_local std::vector<Channel *> reclaim_;  // Closed channels, deleted once per loop
+  static thread_local Reactor::PrepareHandle reclaim_hook_;  // 0 until the first channel
+  static thread_local unsigned char *        recv_buffer_;
 };
 
 class Acceptor {
+public:
+  constexpr static int DEFAULT_BACKLOG = 1024;  // Capped by net.core.somaxconn
+
 public:
   Acceptor(Reactor *reactor = nullptr);
   virtual ~Acceptor();
 
-  virtual int listen(int port);
+  // reuse_port lets several acceptors, one per reactor, share the port
+  // fast_open accepts data carried on the SYN, up to backlog pending TFO requests
+  // transparent accepts connections TPROXY diverted to the port, whatever their destination
+  virtual int listen(int  port,
+                     int  backlog     = DEFAULT_BACKLOG,
+                     bool reuse_port  = false,
+                     bool fast_open   = false,
+                     bool transparent = false);
   virtual int start();
 
   // Callbacks
@@ -21,31 +21,193 @@
 // SOFTWARE.
 
 #include "Reactor.h"
+#include "UringReactor.h"
+#include "stats.h"
 
 struct TimerInfo {
-  Reactor::Callback *handler;
-  int                evId;
+  Reactor::Callback *  handler;
+  int                  evId;
+  Reactor *            reactor;
+  Reactor::TimerHandle handle;  // Of the timer or the prepare
 };
 
-Reactor::Reactor() {
-  loop_ = ev_default_loop(0);
+static void release_timer(ev_timer *timer) {
+  delete ((reinterpret_cast<TimerInfo *>(timer->data))->handler);
+  delete (reinterpret_cast<TimerInfo *>(timer->data));
+  delete (timer);
+  stats::sub(stats::TIMERS_ACTIVE);
+}
+
+static void release_prepare(ev_prepare *prepare) {
+  delete ((reinterpret_cast<TimerInfo *>(prepare->data))->handler);
+  delete (reinterpret_cast<TimerInfo *>(prepare->data));
+  delete (prepare);
+}
+
+Reactor *Reactor::create(bool io_uring) {
+  if (io_uring) {
+    auto *reactor = UringReactor::create();
+    if (reactor) {
+      LOG_INFO << "io_uring reactor enabled";
+      return reactor;
+    }
+    LOG_WARN << "io_uring is not available, fall back to libev";
+  }
+  return new Reactor;
+}
+
+struct Reactor::CallbackIO : Reactor::IOWatcher {
+  int call(int fd) { return callback(fd); }
+
+  Callback callback;
+};
+
+struct Reactor::TaskNode {
+  std::atomic<TaskNode *> next{nullptr};
+  Task                    task;
+};
+
+static void async_callback(EV_P_ ev_async *w, int revents) {
+  static_cast<Reactor *>(w->data)->RunTasks();
+}
+
+Reactor::Reactor()
+  : firing_(nullptr)
+  , tasks_tail_(new TaskNode)
+  , wakeup_pending_(false)
+  , task_batch_(DEFAULT_TASK_BATCH) {
+  // The default loop also handles signals and child watchers, extra reactors get their own
+  static std::atomic<bool> has_default{false};
+  loop_       = has_default.exchange(true) ? ev_loop_new(EVFLAG_AUTO) : ev_default_loop(0);
+  tasks_head_ = tasks_tail_.load(std::memory_order_relaxed);
+  ev_async_init(&wakeup_, async_callback);
+  wakeup_.data = this;
+  ev_async_start(loop_, &wakeup_);
+  // Waiting for posts alone does not keep Run going
+  ev_unref(loop_);
+}
+
+Reactor::~Reactor() {
+  ev_ref(loop_);
+  ev_async_stop(loop_, &wakeup_);
+  // Tasks still queued are dropped, their posters outlived this reactor
+  while (tasks_head_) {
+    auto *next = tasks_head_->next.load(std::memory_order_acquire);
+    delete tasks_head_;
+    tasks_head_ = next;
+  }
+  // Watchers allocated here, the ones embedded in their owners are left to them
+  timers_.for_each([this](ev_timer *timer) {
+    ev_timer_stop(loop_, timer);
+    release_timer(timer);
+  });
+  prepares_.for_each([this](ev_prepare *prepare) {
+    ev_prepare_stop(loop_, prepare);
+    release_prepare(prepare);
+  });
+  for (auto *watcher : callbacks_) {
+    if (watcher) {
+      StopIO(*watcher);
+      delete watcher;
+    }
+  }
+  for (auto &it : writables_) {
+    ev_io_stop(loop_, it.second);
+    delete ((Callback *)it.second->data);
+    delete (it.second);
+  }
+  // The default loop also serves signals for the whole process and stays
+  if (!ev_is_default_loop(loop_)) {
+    ev_loop_destroy(loop_);
+  }
 }
 
 static void timer_callback(EV_P_ ev_timer *w, int revents) {
+  auto *info = (TimerInfo *)w->data;
+  if (info && info->reactor) {
+    info->reactor->OnTimer(w);
+  }
+}
+
+void Reactor::OnTimer(ev_timer *timer) {
+  auto *info = reinterpret_cast<TimerInfo *>(timer->data);
+  firing_    = timer;
+  (*info->handler)(info->evId);
+  firing_ = nullptr;
+  if (!ev_is_active(timer)) {
+    // A fired one-shot timer, or one removed by its own callback
+    auto *registered = timers_.get(info->handle);
+    if (registered && *registered == timer) {
+      timers_.erase(info->handle);
+    }
+    release_timer(timer);
+  }
+}
+
+static void prepare_callback(EV_P_ ev_prepare *w, int revents) {
   auto *info = (TimerInfo *)w->data;
   if (info && info->handler) {
-    Reactor::Callback &callback = *info->handler;
-    callback(info->evId);
+    (*info->handler)(info->evId);
   }
 }
 
 static void io_callback(EV_P_ ev_io *w, int revents) {
+  auto *watcher = static_cast<Reactor::IOWatcher *>(w);
+  watcher->handler(w->fd);
+}
+
+static void timer_watcher_callback(EV_P_ ev_timer *w, int revents) {
+  if (!ev_is_active(w)) {
+    // libev stopped the fired one-shot timer
+    stats::sub(stats::TIMERS_ACTIVE);
+  }
+  static_cast<Reactor::TimerWatcher *>(w)->handler(0);
+}
+
+static void writable_callback(EV_P_ ev_io *w, int revents) {
   auto *handler = (Reactor::Callback *)w->data;
   if (handler) {
     (*handler)(w->fd);
   }
 }
 
+void Reactor::Post(Task task) {
+  auto *node = new TaskNode;
+  node->task = std::move(task);
+  // Linked after the swap, the reactor stops at a node whose next is not written yet and picks the
+  // rest up on the wakeup this post sends or one already pending
+  auto *prev = tasks_tail_.exchange(node, std::memory_order_acq_rel);
+  prev->next.store(node, std::memory_order_release);
+  if (!wakeup_pending_.exchange(true, std::memory_order_acq_rel)) {
+    stats::add(stats::TASK_WAKEUPS);
+    ev_async_send(loop_, &wakeup_);
+  }
+}
+
+void Reactor::RunTasks() {
+  // Cleared first, a post racing with the drain below sends one more wakeup instead of none, and
+  // acquiring the flag makes the links of the posts that skipped their wakeup visible
+  wakeup_pending_.exchange(false, std::memory_order_acq_rel);
+  int run = 0;
+  while (task_batch_ <= 0 || run < task_batch_) {
+    auto *next = tasks_head_->next.load(std::memory_order_acquire);
+    if (next == nullptr) {
+      break;
+    }
+    delete tasks_head_;
+    tasks_head_ = next;
+    Task task   = std::move(next->task);
+    task();
+    ++run;
+  }
+  stats::add(stats::TASKS_RUN, run);
+  if (tasks_head_->next.load(std::memory_order_acquire) &&
+      !wakeup_pending_.exchange(true, std::memory_order_acq_rel)) {
+    // Over the batch, come back after the IO of the next iteration
+    ev_async_send(loop_, &wakeup_);
+  }
+}
+
 void Reactor::Run() {
   ev_run(loop_, 0);
 }
@@ -54,37 +216,136 @@ void Reactor::Stop(int nStopCode) {
   ev_break(loop_, nStopCode);
 }
 
-void Reactor::RegisterTimer(Callback &handler, int evId, double elapse, double after) {
-  auto *timer = new ev_timer;
-  timer->data = new TimerInfo{new Callback(handler), evId};
+Reactor::TimerHandle Reactor::RegisterTimer(Callback &handler, double elapse, double after) {
+  auto *timer  = new ev_timer;
+  auto *info   = new TimerInfo{new Callback(handler), 0, this, 0};
+  timer->data  = info;
+  info->handle = timers_.insert(timer);
   ev_timer_init(timer, timer_callback, after, 0.001 * elapse);
   ev_timer_start(loop_, timer);
-  timers_[evId] = timer;
+  stats::add(stats::TIMERS_ACTIVE);
+  return info->handle;
 }
 
-void Reactor::RemoveTimer(int evId) {
-  auto *timer = timers_[evId];
-  if (timer) {
-    ev_timer_stop(loop_, timer);
-    delete ((reinterpret_cast<TimerInfo *>(timer->data))->handler);
-    delete (reinterpret_cast<TimerInfo *>(timer->data));
-    delete (timer);
+void Reactor::RemoveTimer(TimerHandle handle) {
+  auto *registered = timers_.get(handle);
+  if (registered == nullptr) {
+    return;
+  }
+  auto *timer = *registered;
+  timers_.erase(handle);
+  ev_timer_stop(loop_, timer);
+  if (timer != firing_) {
+    release_timer(timer);
   }
 }
 
 void Reactor::RegisterIO(Callback &handler, int fd) {
+  if (fd >= (int)callbacks_.size()) {
+    callbacks_.resize(fd + 1, nullptr);
+  }
+  auto *&watcher = callbacks_[fd];
+  if (!watcher) {
+    watcher          = new CallbackIO;
+    watcher->handler = Handler::of<CallbackIO, &CallbackIO::call>(watcher);
+  }
+  StartIO(*watcher, fd);
+  watcher->callback = handler;
+}
+
+void Reactor::RemoveIO(int fd) {
+  if (fd >= 0 && fd < (int)ios_.size() && ios_[fd]) {
+    StopIO(*ios_[fd]);
+  }
+}
+
+void Reactor::StartIO(IOWatcher &watcher, int fd) {
+  StopIO(watcher);
+  if (fd >= (int)ios_.size()) {
+    ios_.resize(fd + 1, nullptr);
+  }
+  if (ios_[fd]) {
+    StopIO(*ios_[fd]);
+  }
+  ev_io_init(&watcher, io_callback, fd, EV_READ);
+  ev_io_start(loop_, &watcher);
+  ios_[fd] = &watcher;
+}
+
+void Reactor::StopIO(IOWatcher &watcher) {
+  ev_io_stop(loop_, &watcher);
+  if (watcher.fd >= 0 && watcher.fd < (int)ios_.size() && ios_[watcher.fd] == &watcher) {
+    ios_[watcher.fd] = nullptr;
+  }
+}
+
+void Reactor::StartTimer(TimerWatcher &watcher, double after, double repeat) {
+  StopTimer(watcher);
+  ev_timer_init(&watcher, timer_watcher_callback, after, repeat);
+  ev_timer_start(loop_, &watcher);
+  stats::add(stats::TIMERS_ACTIVE);
+}
+
+void Reactor::StopTimer(TimerWatcher &watcher) {
+  if (ev_is_active(&watcher)) {
+    ev_timer_stop(loop_, &watcher);
+    stats::sub(stats::TIMERS_ACTIVE);
+  }
+}
+
+void Reactor::RegisterWritable(Callback &handler, int fd) {
   auto *io = new ev_io;
   io->data = new Callback(handler);
-  ev_io_init(io, io_callback, fd, EV_READ);
-  ev_io_start(loop_, io);
-  ios_[fd] = io;
+  ev_io_init(io, writable_callback, fd, EV_WRITE);
+  writables_[fd] = io;
 }
 
-void Reactor::RemoveIO(int fd) {
-  auto *io = ios_[fd];
-  if (io) {
-    ev_io_stop(loop_, io);
-    delete ((Callback *)io->data);
-    delete (io);
+void Reactor::WatchWritable(int fd, bool watch) {
+  auto it = writables_.find(fd);
+  if (it == writables_.end()) {
+    return;
+  }
+  if (watch) {
+    ev_io_start(loop_, it->second);
+  } else {
+    ev_io_stop(loop_, it->second);
+  }
+}
+
+void Reactor::RemoveWritable(int fd) {
+  auto it = writables_.find(fd);
+  if (it != writables_.end()) {
+    ev_io_stop(loop_, it->second);
+    delete ((Callback *)it->second->data);
+    delete (it->second);
+    writables_.erase(it);
   }
 }
+
+Reactor::PrepareHandle Reactor::RegisterPrepare(Callback &handler) {
+  auto *prepare = new ev_prepare;
+  auto *info    = new TimerInfo{new Callback(handler), 0, this, 0};
+  prepare->data = info;
+  info->handle  = prepares_.insert(prepare);
+  ev_prepare_init(prepare, prepare_callback);
+  ev_prepare_start(loop_, prepare);
+  return info->handle;
+}
+
+void Reactor::RemovePrepare(PrepareHandle handle) {
+  auto *registered = prepares_.get(handle);
+  if (registered == nullptr) {
+    return;
+  }
+  auto *prepare = *registered;
+  prepares_.erase(handle);
+  ev_prepare_stop(loop_, prepare);
+  release_prepare(prepare);
+}
+
+void Reactor::InvokePrepares() {
+  prepares_.for_each([](ev_prepare *prepare) {
+    auto *info = reinterpret_cast<TimerInfo *>(prepare->data);
+    (*info->handler)(info->evId);
+  });
+}
@@ -24,28 +24,127 @@
 #define KCPSS_REACTOR_H
 
 #include "public.h"
+#include "slot_map.h"
 
 class Reactor {
 public:
   using Callback = std::function<int(int)>;
+  using Task     = std::function<void()>;
+  // Names a timer until it is removed or a one-shot fired, a stale handle is ignored, 0 is never
+  // issued
+  using TimerHandle = slot_map<ev_timer *>::handle;
+  // Names a prepare until it is removed, like a TimerHandle
+  using PrepareHandle = slot_map<ev_prepare *>::handle;
+  // A received datagram, the buffer is only valid until this returns
+  using DatagramCallback = std::function<void(unsigned char *buffer, int size,
+                                              const struct sockaddr *from, socklen_t len)>;
+  // A SendDatagram datagram the socket refused, with the errno of the send
+  using SendErrorCallback = std::function<void(int error, unsigned char *buffer, int size,
+                                               const struct sockaddr *to, socklen_t len)>;
+
+  // A member function and its object, copied and called without allocating
+  struct Handler {
+    Handler(void *object = nullptr, int (*call)(void *, int) = nullptr)
+      : object(object), call(call) {}
+
+    template<typename T, int (T::*Method)(int)>
+    static Handler of(T *object) {
+      return Handler(object, [](void *p, int arg) { return (static_cast<T *>(p)->*Method)(arg); });
+    }
+    template<typename T, int (T::*Method)()>
+    static Handler of(T *object) {
+      return Handler(object, [](void *p, int) { return (static_cast<T *>(p)->*Method)(); });
+    }
+
+    int operator()(int arg) const { return call(object, arg); }
+
+    void *object;
+    int (*call)(void *, int);
+  };
+
+  // Watchers embedded in their owner, starting and stopping them never allocates
+  struct IOWatcher : ev_io {
+    IOWatcher() {
+      ev_init(this, nullptr);
+      fd = -1;
+    }
+    Handler handler;  // Called with the fd
+  };
+  struct TimerWatcher : ev_timer {
+    TimerWatcher() { ev_init(this, nullptr); }
+    Handler handler;  // Called with 0
+  };
 
 public:
+  // An io_uring reactor if asked for and the kernel supports it, the libev one otherwise
+  static Reactor *create(bool io_uring);
+
+  constexpr static int DEFAULT_TASK_BATCH = 64;
+
   Reactor();
+  virtual ~Reactor();
   virtual void Run();
   void         Stop(int nStopCode = 0);
 
-  // IO
+  // IO, RemoveIO stops whichever watcher reads the fd
   virtual void RegisterIO(Callback &handler, int fd);
   virtual void RemoveIO(int fd);
+  void         StartIO(IOWatcher &watcher, int fd);
+  void         StopIO(IOWatcher &watcher);
+  // Write readiness, registered stopped and only watched while output waits for buffer room
+  virtual void RegisterWritable(Callback &handler, int fd);
+  virtual void WatchWritable(int fd, bool watch);
+  virtual void RemoveWritable(int fd);
+  // Datagram sockets, false if the reactor has no faster path than RegisterIO and sendmsg, failed
+  // gets the SendDatagram datagrams back whose send completed with an error, EAGAIN and ENOBUFS
+  // included
+  virtual bool RegisterDatagrams(DatagramCallback &handler, SendErrorCallback &failed, int fd) {
+    return false;
+  }
+  virtual void RemoveDatagrams(int fd) {}
+  virtual bool SendDatagram(int fd, const struct msghdr &msg) { return false; }
+
+  // Timers, elapse is the repeat interval in ms, 0 fires once, after seconds
+  TimerHandle RegisterTimer(Callback &handler, double elapse, double after = 0);
+  void        RemoveTimer(TimerHandle handle);
+  // Seconds, a repeat of 0 fires once, restarting an active watcher reschedules it
+  void StartTimer(TimerWatcher &watcher, double after, double repeat = 0);
+  void StopTimer(TimerWatcher &watcher);
+
+  // Called with 0 once per loop iteration, right before the loop waits for events
+  PrepareHandle RegisterPrepare(Callback &handler);
+  void          RemovePrepare(PrepareHandle handle);
+
+  // Any thread, the task runs on the reactor thread, tasks of one thread in posting order
+  void Post(Task task);
+  // Tasks run per wakeup, the rest wait for the next loop iteration so IO is not starved, 0 runs
+  // all of them
+  void SetTaskBatch(int batch) { task_batch_ = batch; }
+
+  void OnTimer(ev_timer *timer);
+  void RunTasks();
+
+protected:
+  struct CallbackIO;
+  struct TaskNode;
 
-  // Timers
-  void RegisterTimer(Callback &handler, int evId, double elapse, double after = 0);
-  void RemoveTimer(int evId);
+  void InvokePrepares();
 
 protected:
-  struct ev_loop *                    loop_;
-  std::unordered_map<int, ev_timer *> timers_;
-  std::unordered_map<int, ev_io *>    ios_;
+  struct ev_loop *                      loop_;
+  slot_map<ev_timer *>                  timers_;
+  std::vector<IOWatcher *>              ios_;        // By fd, the watcher reading it
+  std::vector<CallbackIO *>             callbacks_;  // By fd, kept for the next RegisterIO
+  std::unordered_map<int, ev_io *>      writables_;
+  slot_map<ev_prepare *>                prepares_;
+  ev_timer *                            firing_;
+  // Lock free multi producer queue, producers swap themselves in at tail_, the reactor pops after
+  // head_, a consumed node stays behind as the next head_
+  std::atomic<TaskNode *>               tasks_tail_;
+  TaskNode *                            tasks_head_;
+  std::atomic<bool>                     wakeup_pending_;  // Skip ev_async_send until it is served
+  ev_async                              wakeup_;
+  int                                   task_batch_;
 };
 
 #endif  // KCPSS_REACTOR_H
@@ -0,0 +1,492 @@
+// MIT License
+//
+// Copyright (c) 2020 Gui Yang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#include "UringReactor.h"
+#include "stats.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+
+// user_data of a request, its kind, the serial of a receiver and an fd or a send slot
+enum request : uint64_t { RECV = 1, SEND, CANCEL, PROBE };
+
+static uint64_t user_data(request kind, uint32_t serial, uint32_t index) {
+  return (uint64_t)kind << 56 | (uint64_t)(serial & 0xFFFFFFU) << 32 | index;
+}
+
+static request kind_of(uint64_t data) {
+  return (request)(data >> 56);
+}
+
+static uint32_t serial_of(uint64_t data) {
+  return (uint32_t)(data >> 32) & 0xFFFFFFU;
+}
+
+static uint32_t index_of(uint64_t data) {
+  return (uint32_t)data;
+}
+
+static void prep(io_uring_sqe *sqe, uint8_t op, int fd, const void *addr, uint64_t data) {
+  sqe->opcode    = op;
+  sqe->fd        = fd;
+  sqe->addr      = (uint64_t)(uintptr_t)addr;
+  sqe->len       = 1;
+  sqe->user_data = data;
+}
+
+static void prep_recv(io_uring_sqe *sqe, int fd, const struct msghdr *msg, uint64_t data) {
+  prep(sqe, IORING_OP_RECVMSG, fd, msg, data);
+  sqe->ioprio    = IORING_RECV_MULTISHOT;
+  sqe->flags     = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+}
+
+static void prep_cancel(io_uring_sqe *sqe, uint64_t target) {
+  prep(sqe, IORING_OP_ASYNC_CANCEL, -1, nullptr, user_data(CANCEL, 0, 0));
+  sqe->addr = target;
+  sqe->len  = 0;
+}
+
+uring::~uring() {
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+  if (event_fd_ >= 0) {
+    close(event_fd_);
+  }
+  if (sqes_) {
+    munmap(sqes_, sqes_size_);
+  }
+  if (cq_ring_ && cq_ring_ != sq_ring_) {
+    munmap(cq_ring_, cq_ring_size_);
+  }
+  if (sq_ring_) {
+    munmap(sq_ring_, sq_ring_size_);
+  }
+  if (buf_ring_) {
+    munmap(buf_ring_, buffer_count_ * sizeof(io_uring_buf));
+  }
+  if (buffers_) {
+    munmap(buffers_, (size_t)buffer_count_ * buffer_size_);
+  }
+}
+
+bool uring::open(unsigned entries) {
+  // Deferred task work completes requests when we enter the ring, not by interrupting the
+  // loop, kernels before 6.1 lack it and take the default mode
+  io_uring_params p{};
+  p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+  fd_     = (int)syscall(__NR_io_uring_setup, entries, &p);
+  if (fd_ < 0) {
+    p   = {};
+    fd_ = (int)syscall(__NR_io_uring_setup, entries, &p);
+  }
+  if (fd_ < 0) {
+    return false;
+  }
+  deferred_ = p.flags & IORING_SETUP_DEFER_TASKRUN;
+  // Signaled for deferred work as well, polling the ring fd only sees posted completions
+  event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (event_fd_ < 0 ||
+      syscall(__NR_io_uring_register, fd_, IORING_REGISTER_EVENTFD, &event_fd_, 1) < 0) {
+    return false;
+  }
+  sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  bool single   = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single) {
+    sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+  }
+  void *sq = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_,
+                  IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED) {
+    return false;
+  }
+  sq_ring_ = sq;
+  void *cq = single ? sq
+                    : mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+  if (cq == MAP_FAILED) {
+    return false;
+  }
+  cq_ring_   = cq;
+  sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+  void *sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_,
+                    IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    return false;
+  }
+  sqes_ = static_cast<io_uring_sqe *>(sqes);
+
+  auto *sq_base = static_cast<unsigned char *>(sq);
+  auto *cq_base = static_cast<unsigned char *>(cq);
+  sq_head_      = reinterpret_cast<unsigned *>(sq_base + p.sq_off.head);
+  sq_tail_      = reinterpret_cast<unsigned *>(sq_base + p.sq_off.tail);
+  sq_flags_     = reinterpret_cast<unsigned *>(sq_base + p.sq_off.flags);
+  sq_mask_      = *reinterpret_cast<unsigned *>(sq_base + p.sq_off.ring_mask);
+  sq_entries_   = p.sq_entries;
+  sq_queued_    = *sq_tail_;
+  // sqes are filled in ring order, so the index array never changes
+  auto *array = reinterpret_cast<unsigned *>(sq_base + p.sq_off.array);
+  for (unsigned i = 0; i < sq_entries_; ++i) {
+    array[i] = i;
+  }
+  cq_head_ = reinterpret_cast<unsigned *>(cq_base + p.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned *>(cq_base + p.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<unsigned *>(cq_base + p.cq_off.ring_mask);
+  cqes_    = reinterpret_cast<io_uring_cqe *>(cq_base + p.cq_off.cqes);
+  return true;
+}
+
+bool uring::provide(unsigned count, unsigned size) {
+  void *ring = mmap(nullptr, count * sizeof(io_uring_buf), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED) {
+    return false;
+  }
+  buf_ring_     = static_cast<io_uring_buf_ring *>(ring);
+  buffer_count_ = count;
+  // Pages are only backed once a datagram lands in them
+  void *buffers = mmap(nullptr, (size_t)count * size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (buffers == MAP_FAILED) {
+    return false;
+  }
+  buffers_     = static_cast<unsigned char *>(buffers);
+  buffer_size_ = size;
+
+  io_uring_buf_reg reg{};
+  reg.ring_addr    = (uint64_t)(uintptr_t)ring;
+  reg.ring_entries = count;
+  reg.bgid         = 0;
+  if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    return false;
+  }
+  for (unsigned bid = 0; bid < count; ++bid) {
+    recycle(bid);
+  }
+  return true;
+}
+
+io_uring_sqe *uring::next_sqe() {
+  if (sq_queued_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+    submit();
+    if (sq_queued_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+      return nullptr;
+    }
+  }
+  auto *sqe = &sqes_[sq_queued_++ & sq_mask_];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+int uring::submit(unsigned wait, bool run) {
+  __atomic_store_n(sq_tail_, sq_queued_, __ATOMIC_RELEASE);
+  unsigned pending = sq_queued_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  // Getting events runs deferred work and moves overflown completions back into the queue
+  bool get = wait > 0 || overflown() || (deferred_ && (run || pending > 0));
+  if (pending == 0 && !get) {
+    return 0;
+  }
+  int ret;
+  do {
+    ret = (int)syscall(__NR_io_uring_enter, fd_, pending, wait, get ? IORING_ENTER_GETEVENTS : 0,
+                       nullptr, 0);
+  } while (ret < 0 && errno == EINTR);
+  return ret < 0 ? -errno : ret;
+}
+
+io_uring_cqe *uring::peek() {
+  unsigned head = *cq_head_;
+  if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+    return nullptr;
+  }
+  return &cqes_[head & cq_mask_];
+}
+
+void uring::advance() {
+  __atomic_store_n(cq_head_, *cq_head_ + 1, __ATOMIC_RELEASE);
+}
+
+bool uring::overflown() const {
+  return __atomic_load_n(sq_flags_, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW;
+}
+
+void uring::recycle(unsigned bid) {
+  // Not through bufs, the flexible array moves by the empty struct C++ builds of the header add
+  auto &buf = reinterpret_cast<io_uring_buf *>(buf_ring_)[buf_tail_ & (buffer_count_ - 1)];
+  buf.addr  = (uint64_t)(uintptr_t)buffer(bid);
+  buf.len   = buffer_size_;
+  buf.bid   = (unsigned short)bid;
+  __atomic_store_n(&buf_ring_->tail, ++buf_tail_, __ATOMIC_RELEASE);
+}
+
+UringReactor *UringReactor::create() {
+  auto *ring = new uring;
+  if (!ring->open(ENTRIES) || !ring->provide(BUFFERS, BUFFER_SIZE) || !supported(ring)) {
+    LOG_DBUG << "io_uring setup failed, errno " << errno;
+    delete ring;
+    return nullptr;
+  }
+  return new UringReactor(ring);
+}
+
+bool UringReactor::supported(uring *ring) {
+  // Kernels before 6.0 fail a multishot recvmsg with EINVAL, try one on a socket of our own
+  int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0) {
+    return false;
+  }
+  struct msghdr msg {};
+  prep_recv(ring->next_sqe(), fd, &msg, user_data(PROBE, 0, 0));
+  prep_cancel(ring->next_sqe(), user_data(PROBE, 0, 0));
+  bool ok = ring->submit(2) >= 0;
+  for (int seen = 0; ok && seen < 2;) {
+    auto *cqe = ring->peek();
+    if (!cqe) {
+      ok = ring->submit(1) >= 0;
+      continue;
+    }
+    if (kind_of(cqe->user_data) == PROBE && cqe->res == -EINVAL) {
+      ok = false;
+    }
+    ring->advance();
+    seen++;
+  }
+  close(fd);
+  return ok;
+}
+
+UringReactor::UringReactor(uring *ring) : ring_(ring), slots_(SEND_SLOTS) {
+  for (int i = SEND_SLOTS - 1; i >= 0; --i) {
+    free_slots_.push_back(i);
+  }
+  Callback cb = std::bind(&UringReactor::on_ring, this);
+  RegisterIO(cb, ring_->event_fd());
+  // Runs after the prepares that flush output, so it submits what they queued
+  ev_prepare_init(&prepare_, prepare_callback);
+  ev_set_priority(&prepare_, EV_MINPRI);
+  prepare_.data = this;
+  ev_prepare_start(loop_, &prepare_);
+}
+
+UringReactor::~UringReactor() {
+  ev_prepare_stop(loop_, &prepare_);
+  RemoveIO(ring_->event_fd());
+  delete ring_;
+}
+
+bool UringReactor::RegisterDatagrams(DatagramCallback &handler, SendErrorCallback &failed, int fd) {
+  auto &r           = receivers_[fd];
+  r.handler         = handler;
+  r.failed          = failed;
+  r.serial          = ++serial_;
+  r.msg             = {};
+  r.msg.msg_namelen = sizeof(struct sockaddr_storage);
+  arm(fd, r);
+  return true;
+}
+
+void UringReactor::RemoveDatagrams(int fd) {
+  auto it = receivers_.find(fd);
+  if (it == receivers_.end()) {
+    return;
+  }
+  auto *sqe = ring_->next_sqe();
+  if (sqe) {
+    prep_cancel(sqe, user_data(RECV, it->second.serial, fd));
+  }
+  receivers_.erase(it);
+}
+
+bool UringReactor::SendDatagram(int fd, const struct msghdr &msg) {
+  if (free_slots_.empty()) {
+    return false;
+  }
+  auto *sqe = ring_->next_sqe();
+  if (!sqe) {
+    return false;
+  }
+  int index = free_slots_.back();
+  free_slots_.pop_back();
+
+  auto &slot = slots_[index];
+  slot.fd    = fd;
+  slot.bytes.clear();
+  for (size_t i = 0; i < msg.msg_iovlen; ++i) {
+    auto *base = static_cast<unsigned char *>(msg.msg_iov[i].iov_base);
+    slot.bytes.insert(slot.bytes.end(), base, base + msg.msg_iov[i].iov_len);
+  }
+  slot.iov.iov_base   = slot.bytes.data();
+  slot.iov.iov_len    = slot.bytes.size();
+  slot.msg            = {};
+  slot.msg.msg_iov    = &slot.iov;
+  slot.msg.msg_iovlen = 1;
+  if (msg.msg_name) {
+    slot.msg.msg_namelen = std::min<socklen_t>(msg.msg_namelen, sizeof(slot.addr));
+    slot.msg.msg_name    = &slot.addr;
+    memcpy(&slot.addr, msg.msg_name, slot.msg.msg_namelen);
+  }
+  prep(sqe, IORING_OP_SENDMSG, fd, &slot.msg, user_data(SEND, 0, index));
+  return true;
+}
+
+void UringReactor::arm(int fd, receiver &r) {
+  auto *sqe = ring_->next_sqe();
+  if (!sqe) {
+    LOG_CRIT << "io_uring submission queue is full, fd[" << fd << "] stops receiving";
+    return;
+  }
+  prep_recv(sqe, fd, &r.msg, user_data(RECV, r.serial, fd));
+}
+
+bool UringReactor::reap() {
+  bool delivered = false;
+  for (;;) {
+    auto *cqe = ring_->peek();
+    if (!cqe) {
+      if (!ring_->overflown()) {
+        break;
+      }
+      ring_->submit();
+      continue;
+    }
+    // Copied, the slot is the kernel's again once advanced
+    io_uring_cqe done = *cqe;
+    ring_->advance();
+    delivered = complete(done) || delivered;
+  }
+  return delivered;
+}
+
+bool UringReactor::complete(const io_uring_cqe &cqe) {
+  switch (kind_of(cqe.user_data)) {
+    case SEND:
+      sent((int)index_of(cqe.user_data), cqe.res);
+      return false;
+    case RECV:
+      break;
+    default:
+      return false;
+  }
+
+  int      fd         = (int)index_of(cqe.user_data);
+  uint32_t serial     = serial_of(cqe.user_data);
+  bool     has_buffer = cqe.flags & IORING_CQE_F_BUFFER;
+  unsigned bid        = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+  auto     current    = [&]() -> receiver * {
+    auto it = receivers_.find(fd);
+    return it != receivers_.end() && (it->second.serial & 0xFFFFFFU) == serial ? &it->second
+                                                                               : nullptr;
+  };
+
+  bool delivered = false;
+  auto *r        = current();
+  if (r && has_buffer && cqe.res >= 0) {
+    auto *out  = reinterpret_cast<io_uring_recvmsg_out *>(ring_->buffer(bid));
+    auto *name = reinterpret_cast<unsigned char *>(out + 1);
+    if (out->flags & MSG_TRUNC) {
+      LOG_DBUG << "drop truncated datagram on fd[" << fd << "]";
+    } else {
+      socklen_t len = std::min<socklen_t>(out->namelen, r->msg.msg_namelen);
+      r->handler(name + r->msg.msg_namelen, (int)out->payloadlen,
+                 reinterpret_cast<struct sockaddr *>(name), len);
+      delivered = true;
+    }
+  }
+  if (has_buffer) {
+    ring_->recycle(bid);
+  }
+  if (cqe.flags & IORING_CQE_F_MORE) {
+    return delivered;
+  }
+  // The multishot receive ended, the handler may have removed the socket meanwhile
+  r = current();
+  if (!r) {
+    return delivered;
+  }
+  if (cqe.res >= 0 || cqe.res == -ENOBUFS) {
+    arm(fd, *r);
+  } else {
+    LOG_CRIT << "ring recvmsg on fd[" << fd << "] failed, errno " << -cqe.res;
+  }
+  return delivered;
+}
+
+void UringReactor::sent(int index, int res) {
+  auto &slot = slots_[index];
+  if (res < 0) {
+    // Back to the sender, which handles the error as if its own sendmsg had returned it
+    auto  it = receivers_.find(slot.fd);
+    auto *to = slot.msg.msg_name ? reinterpret_cast<struct sockaddr *>(&slot.addr) : nullptr;
+    if (it != receivers_.end() && it->second.failed) {
+      it->second.failed(-res, slot.bytes.data(), (int)slot.bytes.size(), to, slot.msg.msg_namelen);
+    } else if (res == -EAGAIN || res == -ENOBUFS) {
+      LOG_WARN << "ring sendmsg on fd[" << slot.fd << "] found no room, drop the datagram";
+      stats::add(stats::SEND_QUEUE_DROPPED);
+    } else {
+      LOG_WARN << "ring sendmsg on fd[" << slot.fd << "] failed, errno " << -res;
+    }
+  }
+  // Freed last, the handler may send again
+  free_slots_.push_back(index);
+}
+
+int UringReactor::on_ring() {
+  uint64_t count;
+  while (read(ring_->event_fd(), &count, sizeof(count)) < 0 && errno == EINTR) {
+  }
+  ring_->submit(0, true);
+  reap();
+  return 0;
+}
+
+void UringReactor::prepare_callback(EV_P_ ev_prepare *w, int revents) {
+  static_cast<UringReactor *>(w->data)->on_prepare();
+}
+
+void UringReactor::on_prepare() {
+  ring_->submit();
+  // Datagrams completed while submitting may queue output, flush and submit it as well
+  for (int round = 0; round < ROUNDS && reap(); ++round) {
+    InvokePrepares();
+    ring_->submit();
+  }
+  ring_->submit();
+}
+
+#else
+
+UringReactor *UringReactor::create() {
+  return nullptr;
+}
+
+#endif
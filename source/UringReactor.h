@@ -0,0 +1,146 @@
+// MIT License
+//
+// Copyright (c) 2020 Gui Yang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef KCPSS_URING_REACTOR_H
+#define KCPSS_URING_REACTOR_H
+
+#include "Reactor.h"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf_ring;
+
+/** A bare io_uring and one provided buffer ring, set up with raw syscalls. */
+class uring {
+public:
+  ~uring();
+
+  bool open(unsigned entries);
+  // Registers count buffers of size bytes as buffer group 0
+  bool provide(unsigned count, unsigned size);
+  int  fd() const { return fd_; }
+  int  event_fd() const { return event_fd_; }
+
+  // nullptr if the submission queue is still full after submitting what it holds
+  struct io_uring_sqe *next_sqe();
+  // Submits the queued sqes and waits for wait completions, run also completes deferred work
+  // with nothing to submit, returns -errno on failure
+  int submit(unsigned wait = 0, bool run = false);
+  // The oldest completion or nullptr, advance() consumes it
+  struct io_uring_cqe *peek();
+  void                 advance();
+  // The kernel holds completions the full completion queue had no room for
+  bool overflown() const;
+
+  unsigned char *buffer(unsigned bid) const { return buffers_ + (size_t)bid * buffer_size_; }
+  void           recycle(unsigned bid);
+
+private:
+  int                  fd_{-1};
+  int                  event_fd_{-1};
+  bool                 deferred_{false};
+  void *               sq_ring_{nullptr};
+  void *               cq_ring_{nullptr};
+  size_t               sq_ring_size_{0};
+  size_t               cq_ring_size_{0};
+  struct io_uring_sqe *sqes_{nullptr};
+  size_t               sqes_size_{0};
+  struct io_uring_cqe *cqes_{nullptr};
+  unsigned *           sq_head_{nullptr};
+  unsigned *           sq_tail_{nullptr};
+  unsigned *           sq_flags_{nullptr};
+  unsigned             sq_mask_{0};
+  unsigned             sq_entries_{0};
+  unsigned             sq_queued_{0};  // Tail of the sqes filled in, published on submit
+  unsigned *           cq_head_{nullptr};
+  unsigned *           cq_tail_{nullptr};
+  unsigned             cq_mask_{0};
+
+  struct io_uring_buf_ring *buf_ring_{nullptr};
+  unsigned char *           buffers_{nullptr};
+  unsigned                  buffer_count_{0};
+  unsigned                  buffer_size_{0};
+  unsigned short            buf_tail_{0};
+};
+
+/**
+ * Carries datagram sockets over io_uring, libev still waits and runs everything else.
+ *
+ * A socket gets one multishot recvmsg that takes its buffers from the provided buffer ring, a
+ * burst of datagrams costs no syscall at all. Sends are copied into a slot and queued, what a
+ * loop iteration queued is submitted by one io_uring_enter right before the loop waits. An
+ * eventfd tells libev that completions wait.
+ */
+class UringReactor : public Reactor {
+public:
+  const static unsigned ENTRIES     = 1024;         // submission queue size
+  const static unsigned BUFFERS     = 256;          // provided receive buffers, a power of two
+  const static unsigned BUFFER_SIZE = 65536 + 512;  // a datagram, its recvmsg header and address
+  const static int      SEND_SLOTS  = 1024;  // sends in flight, later ones take plain sendmsg
+  const static int      ROUNDS      = 8;     // reap and flush passes before the loop waits
+
+  // nullptr if the kernel lacks multishot recvmsg or provided buffer rings
+  static UringReactor *create();
+  ~UringReactor() override;
+
+  bool RegisterDatagrams(DatagramCallback &handler, SendErrorCallback &failed, int fd) override;
+  void RemoveDatagrams(int fd) override;
+  bool SendDatagram(int fd, const struct msghdr &msg) override;
+
+private:
+  struct receiver {
+    DatagramCallback  handler;
+    SendErrorCallback failed;
+    struct msghdr     msg;
+    uint32_t          serial;
+  };
+
+  struct send_slot {
+    int                        fd;
+    struct msghdr              msg;
+    struct iovec               iov;
+    struct sockaddr_storage    addr;
+    std::vector<unsigned char> bytes;
+  };
+
+  explicit UringReactor(uring *ring);
+  static bool supported(uring *ring);
+
+  void arm(int fd, receiver &r);
+  bool reap();
+  bool complete(const struct io_uring_cqe &cqe);
+  void sent(int index, int res);
+  int  on_ring();
+  void on_prepare();
+
+  static void prepare_callback(EV_P_ ev_prepare *w, int revents);
+
+private:
+  uring *                           ring_;
+  std::unordered_map<int, receiver> receivers_;
+  uint32_t                          serial_{0};
+  std::vector<send_slot>            slots_;
+  std::vector<int>                  free_slots_;
+  ev_prepare                        prepare_{};
+};
+
+#endif  // KCPSS_URING_REACTOR_H
@@ -0,0 +1,77 @@
+// MIT License
+//
+// Copyright (c) 2020 Gui Yang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef KCPSS_EXPIRY_H
+#define KCPSS_EXPIRY_H
+
+#include "public.h"
+
+/**
+ * Coarse timing wheel for idle expiry.
+ *
+ * Keys are filed under the tick their deadline falls in and are checked lazily when that
+ * tick passes: the owner either expires the key or files it again under its new deadline,
+ * so activity costs a timestamp store instead of a wheel update.
+ */
+template<typename Key>
+class expiry_wheel {
+public:
+  explicit expiry_wheel(uint32_t resolution = 1000, size_t slots = 64)
+    : resolution_(resolution), slots_(slots), cursor_(0), started_(false) {}
+
+  void schedule(const Key &key, uint32_t deadline) {
+    uint32_t tick = deadline / resolution_;
+    if (!started_) {
+      cursor_  = tick;
+      started_ = true;
+    }
+    // Too early or too far ahead, park it on the nearest slot and check again then
+    if ((int32_t)(tick - cursor_) < 1) {
+      tick = cursor_ + 1;
+    } else if (tick - cursor_ >= slots_.size()) {
+      tick = cursor_ + (uint32_t)slots_.size() - 1;
+    }
+    slots_[tick % slots_.size()].push_back(key);
+  }
+
+  /** Hands every key whose slot passed to on_due, which may schedule it again. */
+  template<typename F>
+  void advance(uint32_t now, F &&on_due) {
+    uint32_t tick = now / resolution_;
+    while (started_ && (int32_t)(tick - cursor_) > 0) {
+      ++cursor_;
+      std::vector<Key> due;
+      due.swap(slots_[cursor_ % slots_.size()]);
+      for (auto &key : due) {
+        on_due(key);
+      }
+    }
+  }
+
+private:
+  uint32_t                      resolution_;
+  std::vector<std::vector<Key>> slots_;
+  uint32_t                      cursor_;
+  bool                          started_;
+};
+
+#endif  // KCPSS_EXPIRY_H
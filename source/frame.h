@@ -0,0 +1,145 @@
+// MIT License
+//
+// Copyright (c) 2020 Gui Yang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef KCPSS_FRAME_H
+#define KCPSS_FRAME_H
+
+#include "public.h"
+
+/**
+ * CLOSE is a half close, the sender will not write to the stream anymore but still reads.
+ * RESET aborts the stream in both directions.
+ * OPEN_PIPELINED is an OPEN the client already answered locally, data may follow right away
+ * and a failed connect is reported by RESET instead of a socks5 reply. The flags of either
+ * OPEN carry the priority class of the stream.
+ * DATAGRAM carries one udp datagram of a socks5 association, it never enters kcp, see
+ * udp::send_datagram.
+ */
+enum class frame_type : uint8_t {
+  DATA           = 0,
+  OPEN           = 1,
+  CLOSE          = 2,
+  WINDOW_UPDATE  = 3,
+  RESET          = 4,
+  OPEN_PIPELINED = 5,
+  DATAGRAM       = 6,
+};
+
+struct frame_header {
+  frame_type type;
+  uint8_t    flags;
+  uint32_t   sid;
+  uint32_t   length;
+};
+
+/**
+ * Mux frames carried in kcp messages, several frames may share one message.
+ *
+ *   +--------------------------+--------+-----------+---------+
+ *   | version:2 flags:2 type:4 | sid(v) | length(v) | payload |
+ *   +--------------------------+--------+-----------+---------+
+ *
+ * (v) marks unsigned LEB128 varints, so small sids and chunks cost a 3 or 4 byte header.
+ * A length may be padded with 0x80 continuation bytes when its header is written before the
+ * payload size is known, decoders accept both forms.
+ */
+class frame {
+public:
+  constexpr static uint8_t VERSION         = 1;
+  constexpr static int     MAX_HEADER_SIZE = 11;
+  constexpr static int     MIN_SPLIT       = 64;  // Smaller tails of a message are left unused
+
+  static int varint_size(uint32_t value) {
+    int n = 1;
+    while (value >= 0x80U) {
+      value >>= 7U;
+      ++n;
+    }
+    return n;
+  }
+
+  /** width pads the varint to that many bytes, it must not be less than varint_size(value). */
+  static int put_varint(unsigned char *buffer, uint32_t value, int width = 0) {
+    int n = 0;
+    while (value >= 0x80U || n + 1 < width) {
+      buffer[n++] = (unsigned char)(value | 0x80U);
+      value >>= 7U;
+    }
+    buffer[n++] = (unsigned char)value;
+    return n;
+  }
+
+  /** Returns the bytes consumed, 0 if the input is truncated or -1 if it is malformed. */
+  static int get_varint(const unsigned char *buffer, int size, uint32_t *value) {
+    uint32_t result = 0;
+    for (int i = 0; i < size && i < 5; ++i) {
+      result |= (uint32_t)(buffer[i] & 0x7FU) << (7U * i);
+      if (!(buffer[i] & 0x80U)) {
+        *value = result;
+        return i + 1;
+      }
+    }
+    return size < 5 ? 0 : -1;
+  }
+
+  static int header_size(uint32_t sid, uint32_t length) {
+    return 1 + varint_size(sid) + varint_size(length);
+  }
+
+  static int encode_header(unsigned char *buffer,
+                           frame_type     type,
+                           uint8_t        flags,
+                           uint32_t       sid,
+                           uint32_t       length,
+                           int            length_width = 0) {
+    buffer[0] = (unsigned char)(VERSION << 6U | (flags & 0x3U) << 4U | ((uint8_t)type & 0xFU));
+    int n     = 1;
+    n += put_varint(buffer + n, sid);
+    n += put_varint(buffer + n, length, length_width);
+    return n;
+  }
+
+  /** Returns the header size, 0 if the input is truncated or -1 if it is malformed. */
+  static int decode_header(const unsigned char *buffer, int size, frame_header *header) {
+    if (size < 1) {
+      return 0;
+    }
+    if (buffer[0] >> 6U != VERSION) {
+      return -1;
+    }
+    header->type  = (frame_type)(buffer[0] & 0xFU);
+    header->flags = (buffer[0] >> 4U) & 0x3U;
+    int n         = 1;
+    int ret       = get_varint(buffer + n, size - n, &header->sid);
+    if (ret <= 0) {
+      return ret;
+    }
+    n += ret;
+    ret = get_varint(buffer + n, size - n, &header->length);
+    if (ret <= 0) {
+      return ret;
+    }
+    return n + ret;
+  }
+};
+
+#endif  // KCPSS_FRAME_H
@@ -27,131 +27,744 @@
 #include "codec.h"
 #include "Acceptor.h"
 #include "socks5.h"
+#include "stats.h"
+#include "expiry.h"
+#include "timeUtility.h"
 
 struct proxy_config {
   std::string local;
   std::string remote;
   codec *     remote_codec{new null_codec};
+  int         max_mtu{udp::DEFAULT_MTU};
+  bool        coalesce{false};
+  int         coalesce_delay{0};
+  bool        stream{false};
+  std::string secret;                // Keys the datagram tags, no default, see parse_config
+  int         session_timeout{300};  // seconds, 0 disables
+  int         stream_timeout{0};     // seconds, 0 disables
+  int         session_rate{0};       // KiB/s per client session, 0 disables
+  int         uplink_rate{0};        // KiB/s of all sessions, shared round robin, 0 disables
+  int         stats_interval{60};    // seconds, 0 disables
+  int         backlog{Acceptor::DEFAULT_BACKLOG};
+  int         acceptors{1};          // Reactor threads sharing the listen port
+  bool        optimistic{false};     // Answer socks5 CONNECT locally, pipeline the payload
+  bool        transparent{false};    // Accept REDIRECT/TPROXY connections besides socks5
+  bool        fast_open{false};      // TFO on the client listener, server upstream connects
+  int         nat_timeout{30};       // seconds, idle nat mappings last, 0 disables keepalive
+  bool        io_uring{false};       // Datagrams over io_uring, libev if the kernel lacks it
+  int         task_batch{Reactor::DEFAULT_TASK_BATCH};  // Posted tasks per wakeup, 0 unlimited
+
+  frame_scheduler::config priority;
+  priority_rules          rules;  // Client side stream classification
 };
 
-constexpr int heartbeat_sid = -1989;
+void log_stats(Reactor *reactor, int interval) {
+  if (interval <= 0) {
+    return;
+  }
+  Reactor::Callback cb = [](int evId) -> int {
+    LOG_INFO << "[STATS] " << stats::dump();
+    return 0;
+  };
+  reactor->RegisterTimer(cb, 1000.0 * interval, interval);
+}
 
 class proxy_client {
 public:
-  proxy_client(const char *local,
-               const char *remote,
-               Reactor *   reactor,
-               codec *     codec = new null_codec)
-    : udp_(reactor, local, remote), codec_(codec), max_sid_(0) {
-    udp::SessionCallbck cb = std::bind(&proxy_client::remote_in, this, _1, _2, _3, _4);
+  proxy_client(const proxy_config &config, Reactor *reactor, int shard = 0)
+    : udp_(reactor, bind_address(config.local, shard).c_str(), config.remote.c_str())
+    , reactor_(reactor)
+    , codec_(config.remote_codec)
+    , max_sid_(0)
+    , optimistic_(config.optimistic)
+    , transparent_(config.transparent)
+    , rules_(config.rules)
+    , local_(config.local.c_str())
+    , relay_buffer_(udp::MAX_MTU) {
+    udp::SessionCallbck cb = std::bind(&proxy_client::remote_in, this, _1, _2, _3, _4, _5);
     udp_.set_session_callback(cb);
-
-    Reactor::Callback heartbeat = [=](int elapse) -> int {
-      char const *kcpss{"kcpss"};
-      udp_.send(-1, heartbeat_sid, (unsigned char *)kcpss, sizeof(kcpss));
+    udp::FlushCallbck flushCb = [](int conv, bool more) -> int {
+      Channel::flush_gathered(more);
       return 0;
     };
-    reactor->RegisterTimer(heartbeat, 19890, 1000);
+    udp_.set_flush_callback(flushCb);
+    udp_.set_max_mtu(config.max_mtu);
+    udp_.set_coalesce(config.coalesce, config.coalesce_delay);
+    udp_.set_stream(config.stream);
+    udp_.set_secret(config.secret);
+    udp_.set_priority_policy(config.priority);
+    udp_.set_keepalive(config.nat_timeout);
+    pipeline_timer_.handler = Reactor::Handler::of<proxy_client, &proxy_client::open_pending>(this);
+    if (shard == 0) {
+      log_stats(reactor, config.stats_interval);
+    }
   }
 
-  int remote_in(int conv, int sid, unsigned char *buffer, int size) {
+  // Every shard runs its own kcp session, only the first one keeps the configured port
+  static std::string bind_address(const std::string &local, int shard) {
+    if (shard == 0) {
+      return local;
+    }
+    endpoint ep(local.c_str());
+    ep.port(0);
+    std::ostringstream os;
+    os << "udp://" << ep;
+    return os.str();
+  }
+
+  int remote_in(int conv, int sid, frame_type type, unsigned char *buffer, int size) {
     LOG_DBUG << "kcp://" << conv << ":" << sid << " remote in " << size << " bytes";
-    if (sid == heartbeat_sid) {
-      return 0;
+    auto it = channels_.find(sid);
+    if (it == channels_.end()) {
+      return -1;
     }
-    codec_->decode(buffer, size);
-    if (channels_.find(sid) != channels_.end()) {
-      return Channel::write(channels_[sid], buffer, size);
+    auto *channel = Channel::get(it->second.channel);
+    if (channel == nullptr) {
+      channels_.erase(it);
+      return -1;
     }
-    return -1;
+    switch (type) {
+      case frame_type::DATA:
+        codec_->decode(buffer, size);
+        return Channel::gather(it->second.channel, buffer, size);
+      case frame_type::DATAGRAM:
+        codec_->decode(buffer, size);
+        return relay_out(sid, buffer, size);
+      case frame_type::CLOSE:
+        channel->shutdown();
+        break;
+      case frame_type::RESET:
+        if (it->second.relay >= 0) {
+          // The server expired the association
+          close_relay(it->second.relay);
+        }
+        channels_.erase(it);
+        // local_closed finds no entry any more, forget the class here
+        udp_.set_priority(-1, sid, -1);
+        channel->reset();
+        break;
+      default:
+        break;
+    }
+    return 0;
   }
 
   int local_in(int sid, unsigned char *buffer, int size) {
     LOG_DBUG << "kcp://NULL:" << sid << " local in " << size << " bytes";
-    if (socks5::is_hello(buffer, size)) {
+    auto &stream = channels_[sid];
+    if (!stream.opened && stream.request.empty() && socks5::is_hello(buffer, size)) {
       // fast return to skip socks5 negotiate & reduce 1 RTT time.
       socks5::echo_hello(buffer, &size);
-      return Channel::write(channels_[sid], buffer, size);
+      return Channel::write(stream.channel, buffer, size);
     }
+    if (stream.relay >= 0) {
+      // The control connection of an association carries nothing
+      return 0;
+    }
+    if (!stream.request.empty()) {
+      open_stream(sid);
+    } else if (!stream.opened && socks5::is_associate(buffer, size)) {
+      return associate(sid, buffer, size);
+    } else if (!stream.opened && optimistic_) {
+      int request_size = socks5::connect_request_size(buffer, size);
+      if (request_size > 0) {
+        return pipeline(sid, buffer, size, request_size);
+      }
+    }
+    // The first message after the hello is the socks5 request, it opens the stream
+    frame_type type = stream.opened ? frame_type::DATA : frame_type::OPEN;
+    if (!stream.opened) {
+      prioritize(sid, buffer, size);
+    }
+    stream.opened = true;
     codec_->encode(buffer, size);
-    return udp_.send(-1, sid, buffer, size);
+    return udp_.send(-1, sid, type, buffer, size);
+  }
+
+  // Answers the CONNECT right away and holds the OPEN back to share a message with the payload
+  int pipeline(int sid, unsigned char *buffer, int size, int request_size) {
+    auto &stream = channels_[sid];
+
+    unsigned char rsp[16];
+    int           rsp_size = socks5::prepare_response(rsp, true);
+    Channel::write(stream.channel, rsp, rsp_size);
+    stream.request.assign(buffer, buffer + request_size);
+    if (size > request_size) {
+      // The client did not wait for the reply
+      open_stream(sid);
+      codec_->encode(buffer + request_size, size - request_size);
+      return udp_.send(-1, sid, frame_type::DATA, buffer + request_size, size - request_size);
+    }
+    return hold_open(sid);
+  }
+
+  int hold_open(int sid) {
+    if (pending_.empty()) {
+      // Protocols where the server speaks first never send a payload
+      reactor_->StartTimer(pipeline_timer_, PIPELINE_WAIT);
+    }
+    pending_.push_back(sid);
+    return 0;
+  }
+
+  int open_stream(int sid) {
+    auto &stream = channels_[sid];
+    prioritize(sid, stream.request.data(), (int)stream.request.size());
+    codec_->encode(stream.request.data(), (int)stream.request.size());
+    int ret = udp_.send(-1, sid, frame_type::OPEN_PIPELINED, stream.request.data(),
+                        (int)stream.request.size());
+    stream.request.clear();
+    stream.opened = true;
+    return ret;
+  }
+
+  // Classifies the stream by its CONNECT request before the OPEN carries the class out
+  void prioritize(int sid, const unsigned char *request, int size) {
+    if (rules_.empty()) {
+      return;
+    }
+    int dscp = -1;
+    if (rules_.uses_dscp()) {
+      auto *channel = Channel::get(channels_[sid].channel);
+      dscp          = channel ? socket::received_dscp(channel->fd()) : -1;
+    }
+    int cls = rules_.classify(request, size, dscp);
+    LOG_DBUG << "sid[" << sid << "] priority class " << cls << ", dscp " << dscp;
+    udp_.set_priority(-1, sid, cls);
+  }
+
+  int open_pending(int evId) {
+    std::vector<int> pending;
+    pending.swap(pending_);
+    for (int sid : pending) {
+      auto it = channels_.find(sid);
+      if (it != channels_.end() && !it->second.request.empty()) {
+        open_stream(sid);
+      }
+    }
+    return 0;
+  }
+
+  // UDP ASSOCIATE, the datagrams of the client go through a relay socket of their own
+  int associate(int sid, unsigned char *buffer, int size) {
+    auto &stream  = channels_[sid];
+    auto *channel = Channel::get(stream.channel);
+    stream.peer   = channel ? socket::peer(channel->fd()) : endpoint::null();
+
+    endpoint bound = local_;
+    bound.port(0);
+    int       fd  = socket::create_udp(bound);
+    socklen_t len = endpoint::capacity();
+    if (::bind(fd, bound.sockaddr(), bound.size()) < 0 ||
+        getsockname(fd, bound.sockaddr(), &len) < 0) {
+      LOG_WARN << "sid[" << sid << "] udp relay failed, errno = " << errno;
+      ::close(fd);
+      unsigned char rsp[16];
+      int           rsp_size = socks5::prepare_response(rsp, false);
+      return Channel::write(stream.channel, rsp, rsp_size);
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    Reactor::Callback cb = std::bind(&proxy_client::relay_in, this, sid, _1);
+    reactor_->RegisterIO(cb, fd);
+    stream.relay  = fd;
+    stream.opened = true;
+    LOG_INFO << "sid[" << sid << "] udp association relayed at " << bound;
+
+    unsigned char rsp[32];
+    int           rsp_size = socks5::prepare_response(rsp, bound);
+    Channel::write(stream.channel, rsp, rsp_size);
+    // Announced like a pipelined open, the server relays datagrams of announced sids only
+    int request_size = socks5::associate_request_size(buffer, size);
+    codec_->encode(buffer, request_size);
+    return udp_.send(-1, sid, frame_type::OPEN_PIPELINED, buffer, request_size);
+  }
+
+  void close_relay(int relay) {
+    reactor_->RemoveIO(relay);
+    ::close(relay);
+  }
+
+  int relay_in(int sid, int fd) {
+    auto it = channels_.find(sid);
+    if (it == channels_.end()) {
+      return 0;
+    }
+    auto &stream = it->second;
+
+    unsigned char *buffer = relay_buffer_.data();
+    while (true) {
+      endpoint  from;
+      socklen_t len = endpoint::capacity();
+      ssize_t   ret = ::recvfrom(fd, buffer, relay_buffer_.size(), 0, from.sockaddr(), &len);
+      if (ret < 0) {
+        break;
+      }
+      // Fragments are not supported, RFC 1928 allows dropping them
+      if (ret <= socks5::UDP_HEADER_SIZE || buffer[0] != 0 || buffer[1] != 0 || buffer[2] != 0) {
+        stats::add(stats::DATAGRAMS_DROPPED);
+        continue;
+      }
+      // RFC 1928 7, only the host of the control connection may use the relay
+      if (!from.same_host(stream.peer)) {
+        stats::add(stats::DATAGRAMS_DROPPED);
+        continue;
+      }
+      if (stream.app.is_null()) {
+        stream.app = from;
+      } else if (from != stream.app) {
+        stats::add(stats::DATAGRAMS_DROPPED);
+        continue;
+      }
+      unsigned char *payload = buffer + socks5::UDP_HEADER_SIZE;
+      int            size    = (int)ret - socks5::UDP_HEADER_SIZE;
+      codec_->encode(payload, size);
+      udp_.send_datagram(-1, sid, payload, size);
+    }
+    return 0;
+  }
+
+  // buffer holds ATYP, DST.ADDR, DST.PORT of the sender and the payload
+  int relay_out(int sid, unsigned char *buffer, int size) {
+    auto &stream = channels_[sid];
+    if (stream.relay < 0 || stream.app.is_null()) {
+      return -1;
+    }
+    unsigned char header[socks5::UDP_HEADER_SIZE] = {0, 0, 0};
+    struct iovec  iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len  = sizeof(header);
+    iov[1].iov_base = buffer;
+    iov[1].iov_len  = size;
+    struct msghdr msg {};
+    msg.msg_name    = const_cast<struct sockaddr *>(stream.app.sockaddr());
+    msg.msg_namelen = stream.app.size();
+    msg.msg_iov     = iov;
+    msg.msg_iovlen  = 2;
+    return ::sendmsg(stream.relay, &msg, 0) < 0 ? -1 : 0;
+  }
+
+  // Once the stream is open reads go straight into kcp segments
+  unsigned char *local_reserve(int sid, int *size) {
+    auto it = channels_.find(sid);
+    if (it == channels_.end()) {
+      return nullptr;
+    }
+    if (!it->second.request.empty()) {
+      // The payload is coming, the OPEN goes first
+      open_stream(sid);
+    }
+    return it->second.opened ? udp_.reserve(-1, sid, size) : nullptr;
+  }
+
+  int local_commit(int sid, unsigned char *buffer, int size) {
+    codec_->encode(buffer, size);
+    return udp_.commit(-1, sid, size);
   }
 
   int accepted(Channel *channel) {
     int sid = max_sid_++;
     LOG_INFO << "Connection accept, fd[" << channel->fd() << "], sid[" << sid << "]";
-    channels_[sid] = channel;
+    channels_[sid] = stream{channel->handle(), false, {}, -1, endpoint::null(), endpoint::null()};
 
     Channel::ReadCallbck cb = std::bind(&proxy_client::local_in, this, sid, _1, _2);
     channel->set_read_callback(cb);
+    Channel::ReserveCallbck reserveCb = std::bind(&proxy_client::local_reserve, this, sid, _1);
+    Channel::ReadCallbck    commitCb  = std::bind(&proxy_client::local_commit, this, sid, _1, _2);
+    channel->set_reserve_callback(reserveCb, commitCb);
+    Channel::Callback eofCb = std::bind(&proxy_client::local_eof, this, sid, _1);
+    channel->set_eof_callback(eofCb);
+    Channel::Callback closeCb = std::bind(&proxy_client::local_closed, this, sid, _1);
+    channel->set_disconnect_callback(closeCb);
+
+    endpoint target = transparent_ ? socket::original_destination(channel->fd(), local_.port())
+                                   : endpoint::null();
+    if (!target.is_null()) {
+      // Redirected by iptables, no socks5 to speak, the stream opens with the first payload
+      LOG_INFO << "sid[" << sid << "] transparent to " << target;
+      unsigned char request[32];
+      int           request_size = socks5::prepare_request(request, target);
+      channels_[sid].request.assign(request, request + request_size);
+      return hold_open(sid);
+    }
     return 0;
   }
 
+  int local_eof(int sid, Channel *channel) {
+    auto it = channels_.find(sid);
+    if (it != channels_.end() && it->second.relay >= 0) {
+      // The association ends with its control connection
+      channel->shutdown();
+      return 0;
+    }
+    if (it != channels_.end() && !it->second.request.empty()) {
+      open_stream(sid);
+    }
+    if (it != channels_.end() && it->second.opened) {
+      return udp_.send(-1, sid, frame_type::CLOSE, nullptr, 0);
+    }
+    // Nothing to wait for before the stream is opened
+    channel->shutdown();
+    return 0;
+  }
+
+  int local_closed(int sid, Channel *channel) {
+    auto it = channels_.find(sid);
+    if (it == channels_.end()) {
+      return 0;
+    }
+    bool opened = it->second.opened;
+    int  relay  = it->second.relay;
+    channels_.erase(it);
+    LOG_INFO << "remove local channel sid[" << sid << "], channel.size[" << channels_.size() << "]";
+    int ret = 0;
+    if (relay >= 0) {
+      // The server drops the association on reset
+      close_relay(relay);
+      ret = udp_.send(-1, sid, frame_type::RESET, nullptr, 0);
+    } else if (opened && !channel->closed_gracefully()) {
+      ret = udp_.send(-1, sid, frame_type::RESET, nullptr, 0);
+    }
+    udp_.set_priority(-1, sid, -1);
+    return ret;
+  }
+
 private:
-  udp                                udp_;
-  codec *                            codec_;
-  std::unordered_map<int, Channel *> channels_;
-  int                                max_sid_;
+  // Seconds a locally answered CONNECT waits for the first payload before the OPEN goes out
+  constexpr static double PIPELINE_WAIT = 0.002;
+
+  struct stream {
+    Channel::Handle            channel;
+    bool                       opened;
+    std::vector<unsigned char> request;  // CONNECT answered locally, OPEN not sent yet
+    int                        relay;    // udp socket of an association, -1 for tcp streams
+    endpoint                   app;      // where the associated client sends from
+    endpoint                   peer;     // client of the control connection, its host relays
+  };
+
+  udp                             udp_;
+  Reactor *                       reactor_;
+  codec *                         codec_;
+  std::unordered_map<int, stream> channels_;
+  std::vector<int>                pending_;  // sids whose OPEN waits for PIPELINE_WAIT
+  Reactor::TimerWatcher           pipeline_timer_;
+  int                             max_sid_;
+  bool                            optimistic_;
+  bool                            transparent_;
+  priority_rules                  rules_;
+  endpoint                        local_;
+  std::vector<unsigned char>      relay_buffer_;
 };
 
 class proxy_server {
 public:
-  explicit proxy_server(const char *local,
-                        codec *     codec   = new null_codec,
-                        Reactor *   reactor = new Reactor)
-    : udp_(reactor, local), reactor_(reactor), codec_(codec) {
-    codec_                 = codec ? codec : new null_codec;
-    udp::SessionCallbck cb = std::bind(&proxy_server::local_in, this, _1, _2, _3, _4);
+  explicit proxy_server(const proxy_config &config, Reactor *reactor = new Reactor)
+    : udp_(reactor, config.local.c_str())
+    , reactor_(reactor)
+    , codec_(config.remote_codec)
+    , relay_buffer_(udp::MAX_MTU)
+    , stream_timeout_(config.stream_timeout > 0 ? (uint32_t)config.stream_timeout * 1000 : 0)
+    , fast_open_(config.fast_open) {
+    codec_                 = codec_ ? codec_ : new null_codec;
+    udp::SessionCallbck cb = std::bind(&proxy_server::local_in, this, _1, _2, _3, _4, _5);
     udp_.set_session_callback(cb);
+    udp::FlushCallbck flushCb = [](int conv, bool more) -> int {
+      Channel::flush_gathered(more);
+      return 0;
+    };
+    udp_.set_flush_callback(flushCb);
+    udp_.set_max_mtu(config.max_mtu);
+    udp_.set_coalesce(config.coalesce, config.coalesce_delay);
+    udp_.set_stream(config.stream);
+    udp_.set_secret(config.secret);
+    udp_.set_priority_policy(config.priority);
+    udp_.set_idle_timeout(config.session_timeout);
+    udp_.set_rate_limit(config.session_rate, config.uplink_rate);
+    udp_server::ReleaseCallback releaseCb = std::bind(&proxy_server::session_released, this, _1);
+    udp_.set_release_callback(releaseCb);
+
+    if (stream_timeout_ > 0) {
+      LOG_INFO << "stream idle timeout " << config.stream_timeout << " s";
+    }
+    // Associations expire even then, nothing else closes their sockets
+    Reactor::Callback expireCb = std::bind(&proxy_server::expire_streams, this);
+    reactor_->RegisterTimer(expireCb, 1000);
+    log_stats(reactor_, config.stats_interval);
   }
 
-  int local_in(int conv, int sid, unsigned char *buffer, int size) {
+  int local_in(int conv, int sid, frame_type type, unsigned char *buffer, int size) {
     LOG_DBUG << "kcp://" << conv << ":" << sid << " local in " << size << " bytes";
-    if (sid == heartbeat_sid) {
+    key_t key = (static_cast<uint64_t>(conv) << 32U) | static_cast<uint32_t>(sid);
+    auto  it  = channels_.find(key);
+    if (it != channels_.end() && Channel::get(it->second) == nullptr) {
+      // Closed before its callbacks were set, e.g. the connect failed right away
+      channels_.erase(it);
+      it = channels_.end();
+    }
+    if (type == frame_type::DATAGRAM) {
+      codec_->decode(buffer, size);
+      return relay_out(conv, sid, buffer, size);
+    }
+    if ((type == frame_type::CLOSE || type == frame_type::RESET) && associations_.count(key)) {
+      dissociate(key);
+      return 0;
+    }
+    if (type == frame_type::DATA) {
+      codec_->decode(buffer, size);
+      return it == channels_.end() ? -1 : Channel::gather(it->second, buffer, size);
+    }
+    if (type == frame_type::CLOSE && it != channels_.end()) {
+      Channel::get(it->second)->shutdown();
+      return 0;
+    }
+    if (type == frame_type::RESET && it != channels_.end()) {
+      auto *channel = Channel::get(it->second);
+      channels_.erase(it);
+      channel->reset();
+      return 0;
+    }
+    bool pipelined = type == frame_type::OPEN_PIPELINED;
+    if ((type != frame_type::OPEN && !pipelined) || it != channels_.end()) {
       return 0;
     }
     codec_->decode(buffer, size);
-    key_t key         = (static_cast<uint64_t>(conv) << 32U) | static_cast<uint32_t>(sid);
-    bool  new_request = channels_.find(key) == channels_.end();
-    if (!new_request) {
-      return Channel::write(channels_[key], buffer, size);
+    if (pipelined && socks5::is_associate(buffer, size)) {
+      return associate(conv, sid, key);
     }
     LOG_INFO << "create channel for conv[" << conv << "] sid[" << sid << "], "
              << "channel.size[" << channels_.size() << "]";
     auto target = socks5::parser_endpoint_from_request(buffer, size);
     bool is_ok  = !target.is_null();
     if (is_ok) {
-      int   fd     = socket::create_tcp(target);
-      auto *remote = new Channel(reactor_, fd, -1);
-      is_ok        = (remote != nullptr);
+      bool  deferred = false;
+      int   fd       = socket::create_tcp(target, fast_open_ ? &deferred : nullptr);
+      auto *remote   = new Channel(reactor_, fd, -1, deferred);
+      is_ok          = (remote != nullptr);
       if (is_ok) {
         Channel::ReadCallbck cb = std::bind(&proxy_server::remote_in, this, conv, _1, _2, sid);
         remote->set_read_callback(cb);
-        Channel::Callback rmMap = [this](Channel *channel) -> int {
-          for (auto pair : channels_) {
-            if (pair.second == channel) {
-              channels_.erase(pair.first);
-              LOG_INFO << "remove proxy client channel, "
-                       << "channel.size[" << channels_.size() << "]";
-              break;
-            }
+        Channel::ReserveCallbck reserveCb = [this, conv, sid](int *size) {
+          return udp_.reserve(conv, sid, size);
+        };
+        Channel::ReadCallbck commitCb = [this, conv, sid](unsigned char *buffer, int size) {
+          codec_->encode(buffer, size);
+          return udp_.commit(conv, sid, size);
+        };
+        remote->set_reserve_callback(reserveCb, commitCb);
+        Channel::Callback eofCb = [this, conv, sid](Channel *channel) -> int {
+          return udp_.send(conv, sid, frame_type::CLOSE, nullptr, 0);
+        };
+        remote->set_eof_callback(eofCb);
+        Channel::Callback rmMap = [this, conv, sid, key](Channel *channel) -> int {
+          udp_.set_priority(conv, sid, -1);
+          if (channels_.erase(key) == 0) {
+            return 0;
+          }
+          LOG_INFO << "remove proxy client channel, "
+                   << "channel.size[" << channels_.size() << "]";
+          if (!channel->closed_gracefully()) {
+            return udp_.send(conv, sid, frame_type::RESET, nullptr, 0);
           }
           return 0;
         };
         remote->set_disconnect_callback(rmMap);
-        channels_[key] = remote;
+        channels_[key] = remote->handle();
+        if (stream_timeout_ > 0) {
+          expiry_.schedule(key, remote->last_active() + stream_timeout_);
+        }
       }
     }
-    unsigned char rsp[16];
-    int           rsp_size = socks5::prepare_response(rsp, is_ok);
-    codec_->encode(rsp, rsp_size);
-    return udp_.send(conv, sid, const_cast<unsigned char *>(rsp), rsp_size);
+    int ret = 0;
+    if (pipelined) {
+      // The client already answered, its data waits in send_buffer_ until the connect is done
+      ret = is_ok ? 0 : udp_.send(conv, sid, frame_type::RESET, nullptr, 0);
+    } else {
+      unsigned char rsp[16];
+      int           rsp_size = socks5::prepare_response(rsp, is_ok);
+      codec_->encode(rsp, rsp_size);
+      ret = udp_.send(conv, sid, frame_type::DATA, rsp, rsp_size);
+    }
+    if (!is_ok) {
+      udp_.set_priority(conv, sid, -1);
+    }
+    return ret;
   }
 
   int remote_in(int conv, unsigned char *buffer, int size, int sid) {
     LOG_DBUG << "kcp://" << conv << ":" << sid << " remote in " << size << " bytes";
     codec_->encode(buffer, size);
-    return udp_.send(conv, sid, buffer, size);
+    return udp_.send(conv, sid, frame_type::DATA, buffer, size);
+  }
+
+  // A socks5 udp association, one socket per address family, opened by the first datagram
+  struct association {
+    int      fd4;
+    int      fd6;
+    uint32_t last_active;
+  };
+
+  // The client answered a UDP ASSOCIATE, datagrams of the sid are relayed from now on
+  int associate(int conv, int sid, uint64_t key) {
+    uint32_t now = now_ms();
+    if (associations_.emplace(key, association{-1, -1, now}).second) {
+      LOG_INFO << "kcp://" << conv << ":" << sid << " udp association";
+      expiry_.schedule(key, now + association_timeout());
+    }
+    return 0;
+  }
+
+  uint32_t association_timeout() const {
+    if (stream_timeout_ > 0) {
+      return stream_timeout_;
+    }
+    return ASSOCIATION_TIMEOUT;
+  }
+
+  // buffer holds ATYP, DST.ADDR, DST.PORT and the payload
+  int relay_out(int conv, int sid, unsigned char *buffer, int size) {
+    endpoint target;
+    int      head = socks5::parse_address(buffer, size, &target);
+    if (head == 0 || target.is_null()) {
+      stats::add(stats::DATAGRAMS_DROPPED);
+      return -1;
+    }
+    key_t key = (static_cast<uint64_t>(conv) << 32U) | static_cast<uint32_t>(sid);
+    auto  it  = associations_.find(key);
+    if (it == associations_.end()) {
+      // Never announced or expired already
+      stats::add(stats::DATAGRAMS_DROPPED);
+      return -1;
+    }
+    it->second.last_active = now_ms();
+
+    int &fd = target.family() == AF_INET6 ? it->second.fd6 : it->second.fd4;
+    if (fd < 0) {
+      endpoint any = target;
+      any.port(0);
+      fd = socket::create_udp(any);
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+      Reactor::Callback cb = std::bind(&proxy_server::relay_in, this, conv, sid, _1);
+      reactor_->RegisterIO(cb, fd);
+      LOG_INFO << "kcp://" << conv << ":" << sid << " udp association, fd[" << fd << "]";
+    }
+    ssize_t ret = ::sendto(fd, buffer + head, size - head, 0, target.sockaddr(), target.size());
+    return ret < 0 ? -1 : 0;
+  }
+
+  int relay_in(int conv, int sid, int fd) {
+    key_t key = (static_cast<uint64_t>(conv) << 32U) | static_cast<uint32_t>(sid);
+    auto  it  = associations_.find(key);
+    if (it != associations_.end()) {
+      it->second.last_active = now_ms();
+    }
+    // Room for the longest address in front of the payload
+    constexpr int  headroom = 1 + 16 + 2;
+    unsigned char *payload  = relay_buffer_.data() + headroom;
+    while (true) {
+      endpoint  from;
+      socklen_t len = endpoint::capacity();
+      ssize_t   ret = ::recvfrom(fd, payload, relay_buffer_.size() - headroom, 0,
+                               from.sockaddr(), &len);
+      if (ret < 0) {
+        break;
+      }
+      unsigned char address[headroom];
+      int           head = socks5::prepare_address(address, from);
+      memcpy(payload - head, address, head);
+      codec_->encode(payload - head, head + (int)ret);
+      udp_.send_datagram(conv, sid, payload - head, head + (int)ret);
+    }
+    return 0;
+  }
+
+  void dissociate(uint64_t key) {
+    auto it = associations_.find(key);
+    if (it == associations_.end()) {
+      return;
+    }
+    LOG_INFO << "kcp://" << (key >> 32U) << ":" << (int)(key & 0xFFFFFFFFU) << " dissociated";
+    for (int fd : {it->second.fd4, it->second.fd6}) {
+      if (fd >= 0) {
+        reactor_->RemoveIO(fd);
+        ::close(fd);
+      }
+    }
+    associations_.erase(it);
+  }
+
+  // The kcp session is gone, so are all of its streams
+  int session_released(int conv) {
+    std::vector<key_t> dissociated;
+    for (auto &association : associations_) {
+      if (static_cast<int>(association.first >> 32U) == conv) {
+        dissociated.push_back(association.first);
+      }
+    }
+    for (auto key : dissociated) {
+      dissociate(key);
+    }
+    std::vector<Channel::Handle> released;
+    for (auto it = channels_.begin(); it != channels_.end();) {
+      if (static_cast<int>(it->first >> 32U) == conv) {
+        released.push_back(it->second);
+        it = channels_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    LOG_INFO << "conv[" << conv << "] released, reset " << released.size() << " channels";
+    for (auto handle : released) {
+      if (auto *channel = Channel::get(handle)) {
+        channel->reset();
+      }
+    }
+    return 0;
+  }
+
+  int expire_streams() {
+    uint32_t now = now_ms();
+    expiry_.advance(now, [this, now](key_t key) {
+      auto it = channels_.find(key);
+      if (it == channels_.end()) {
+        expire_association(key, now);
+        return;
+      }
+      auto *channel = Channel::get(it->second);
+      if (channel == nullptr) {
+        channels_.erase(it);
+        return;
+      }
+      uint32_t deadline = channel->last_active() + stream_timeout_;
+      if ((int32_t)(now - deadline) < 0) {
+        expiry_.schedule(key, deadline);
+        return;
+      }
+      int conv = static_cast<int>(key >> 32U);
+      int sid  = static_cast<int>(key & 0xFFFFFFFFU);
+      LOG_INFO << "kcp://" << conv << ":" << sid << " idle, reset it";
+      stats::add(stats::STREAMS_EXPIRED);
+      channels_.erase(it);
+      udp_.send(conv, sid, frame_type::RESET, nullptr, 0);
+      channel->reset();
+    });
+    return 0;
+  }
+
+  void expire_association(uint64_t key, uint32_t now) {
+    auto it = associations_.find(key);
+    if (it == associations_.end()) {
+      return;
+    }
+    uint32_t deadline = it->second.last_active + association_timeout();
+    if ((int32_t)(now - deadline) < 0) {
+      expiry_.schedule(key, deadline);
+      return;
+    }
+    int conv = static_cast<int>(key >> 32U);
+    int sid  = static_cast<int>(key & 0xFFFFFFFFU);
+    LOG_INFO << "kcp://" << conv << ":" << sid << " udp association idle, reset it";
+    stats::add(stats::STREAMS_EXPIRED);
+    dissociate(key);
+    udp_.send(conv, sid, frame_type::RESET, nullptr, 0);
   }
 
   void start() {
@@ -162,25 +775,84 @@ public:
 
 private:
   using key_t = uint64_t;
-  udp_server                           udp_;
-  Reactor *                            reactor_;
-  codec *                              codec_;
-  std::unordered_map<key_t, Channel *> channels_;
+  // ms an association without datagrams lasts when stream_timeout is not set
+  constexpr static uint32_t ASSOCIATION_TIMEOUT = 300000;
+
+  udp_server                                 udp_;
+  Reactor *                                  reactor_;
+  codec *                                    codec_;
+  std::unordered_map<key_t, Channel::Handle> channels_;
+  std::unordered_map<key_t, association>     associations_;
+  std::vector<unsigned char>                 relay_buffer_;
+  uint32_t                                   stream_timeout_;
+  bool                                       fast_open_;
+  expiry_wheel<key_t>                        expiry_;
 };
 
 void start_server(const proxy_config &config) {
-  proxy_server rsp(config.local.c_str(), config.remote_codec);
+  auto *reactor = Reactor::create(config.io_uring);
+  reactor->SetTaskBatch(config.task_batch);
+  proxy_server rsp(config, reactor);
   rsp.start();
 }
 
+// Reactors of the running shards, the first shard stops the others once its own loop returns
+struct shard_set {
+  std::mutex             lock;
+  std::vector<Reactor *> reactors;
+  bool                   stopping{false};
+};
+
+void run_client(const proxy_config &config, int shard, shard_set *shards) {
+  auto *reactor = Reactor::create(config.io_uring);
+  reactor->SetTaskBatch(config.task_batch);
+  if (shard > 0) {
+    std::lock_guard<std::mutex> guard(shards->lock);
+    if (shards->stopping) {
+      delete reactor;
+      return;
+    }
+    shards->reactors.push_back(reactor);
+  }
+  auto *server = new Acceptor(reactor);
+  server->listen(endpoint(config.local.c_str()).port(), config.backlog, config.acceptors > 1,
+                 config.fast_open, config.transparent);
+  {
+    proxy_client      rsp(config, reactor, shard);
+    Channel::Callback cb = std::bind(&proxy_client::accepted, &rsp, _1);
+    server->set_connect_callback(cb);
+    server->start();
+  }
+  if (shard > 0) {
+    // Nothing may post to the reactor once it is gone
+    std::lock_guard<std::mutex> guard(shards->lock);
+    auto &reactors = shards->reactors;
+    reactors.erase(std::remove(reactors.begin(), reactors.end(), reactor), reactors.end());
+  }
+  // Channels still open are left behind with the loop their watchers were registered on
+  delete server;
+  delete reactor;
+}
+
 void start_client(const proxy_config &config) {
-  auto *reactor = new Reactor;
-  auto *server  = new Acceptor(reactor);
-  server->listen(endpoint(config.local.c_str()).port());
-  proxy_client      rsp(config.local.c_str(), config.remote.c_str(), reactor, config.remote_codec);
-  Channel::Callback cb = std::bind(&proxy_client::accepted, &rsp, _1);
-  server->set_connect_callback(cb);
-  server->start();
+  // The kernel spreads connections over the SO_REUSEPORT listeners of the shards
+  shard_set                set;
+  std::vector<std::thread> threads;
+  for (int shard = 1; shard < config.acceptors; ++shard) {
+    // Copied, each shard owns its config
+    threads.emplace_back(run_client, config, shard, &set);
+  }
+  run_client(config, 0, &set);
+  {
+    std::lock_guard<std::mutex> guard(set.lock);
+    set.stopping = true;
+    for (auto *reactor : set.reactors) {
+      reactor->Post([reactor]() { reactor->Stop(EVBREAK_ALL); });
+    }
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
 }
 
 proxy_config parse_config(const char *config_file, std::string &modeString) {
@@ -205,6 +877,46 @@ proxy_config parse_config(const char *config_file, std::string &modeString) {
     LOG_CRIT << "Running as client connect to " << run_config.remote;
   }
   run_config.remote_codec = new fast_codec;
+  inipp::extract(iniConfig.sections[modeString]["mtu"], run_config.max_mtu);
+  inipp::extract(iniConfig.sections[modeString]["coalesce"], run_config.coalesce);
+  inipp::extract(iniConfig.sections[modeString]["coalesce_delay"], run_config.coalesce_delay);
+  inipp::extract(iniConfig.sections[modeString]["stream"], run_config.stream);
+  inipp::extract(iniConfig.sections[modeString]["fast_open"], run_config.fast_open);
+  inipp::extract(iniConfig.sections[modeString]["secret"], run_config.secret);
+  if (run_config.secret.empty()) {
+    // A key everybody knows would let anyone forge datagrams the tags are meant to drop
+    LOG_CRIT << "[Exit] No secret in the [" << modeString << "] section of " << config_file
+             << ", set the same secret for client and server";
+    exit(EXIT_FAILURE);
+  }
+  inipp::extract(iniConfig.sections[modeString]["io_uring"], run_config.io_uring);
+  inipp::extract(iniConfig.sections[modeString]["task_batch"], run_config.task_batch);
+  inipp::extract(iniConfig.sections["client"]["backlog"], run_config.backlog);
+  inipp::extract(iniConfig.sections["client"]["acceptors"], run_config.acceptors);
+  inipp::extract(iniConfig.sections["client"]["optimistic"], run_config.optimistic);
+  inipp::extract(iniConfig.sections["client"]["transparent"], run_config.transparent);
+  inipp::extract(iniConfig.sections["client"]["nat_timeout"], run_config.nat_timeout);
+  auto &priority = run_config.priority;
+  if (!frame_scheduler::parse_policy(iniConfig.sections[modeString]["priority"], &priority.mode)) {
+    LOG_WARN << "unknown priority policy, priority classes disabled";
+  }
+  if (!frame_scheduler::parse_weights(iniConfig.sections[modeString]["priority_weights"],
+                                      priority.weights)) {
+    LOG_WARN << "priority weights must be positive, keep the defaults";
+  }
+  run_config.rules.parse(iniConfig.sections["client"]["priority_rules"]);
+#ifndef SO_REUSEPORT
+  if (run_config.acceptors > 1) {
+    LOG_WARN << "SO_REUSEPORT is not supported, running a single acceptor";
+    run_config.acceptors = 1;
+  }
+#endif
+  run_config.acceptors = std::max(1, run_config.acceptors);
+  inipp::extract(iniConfig.sections["server"]["session_timeout"], run_config.session_timeout);
+  inipp::extract(iniConfig.sections["server"]["stream_timeout"], run_config.stream_timeout);
+  inipp::extract(iniConfig.sections["server"]["session_rate"], run_config.session_rate);
+  inipp::extract(iniConfig.sections["server"]["uplink_rate"], run_config.uplink_rate);
+  inipp::extract(iniConfig.sections["log"]["stats_interval"], run_config.stats_interval);
 
   auto logLevel = iniConfig.sections["log"]["level"];
   for (auto &ch : logLevel) {
@@ -0,0 +1,325 @@
+// MIT License
+//
+// Copyright (c) 2020 Gui Yang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef KCPSS_PRIORITY_H
+#define KCPSS_PRIORITY_H
+
+#include <sstream>
+
+#include "public.h"
+#include "socket.h"
+#include "socks5.h"
+#include "frame.h"
+
+/**
+ * Frames waiting in front of the kcp send queue, one queue per priority class, class 0 is
+ * the most urgent. A stream keeps its class for life, so its frames keep their order.
+ *
+ * STRICT always drains the most urgent class first, WEIGHTED drains them by deficit round
+ * robin, weight times quantum payload bytes per class and round.
+ */
+class frame_scheduler {
+public:
+  constexpr static int CLASSES       = 4;  // Fits the 2 flag bits of an OPEN frame
+  constexpr static int DEFAULT_CLASS = 2;
+
+  enum policy : int { NONE = 0, STRICT, WEIGHTED };
+
+  struct config {
+    policy mode{NONE};
+    int    weights[CLASSES]{8, 4, 2, 1};
+  };
+
+  static bool parse_policy(const std::string &text, policy *mode) {
+    if (text.empty() || text == "none") {
+      *mode = NONE;
+    } else if (text == "strict") {
+      *mode = STRICT;
+    } else if (text == "weighted") {
+      *mode = WEIGHTED;
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  /** "8,4,2,1", classes left out keep their weight, nothing changes if one is not positive */
+  static bool parse_weights(const std::string &text, int *weights) {
+    std::istringstream is(text);
+    std::string        item;
+    int                parsed[CLASSES];
+    int                count = 0;
+    for (; count < CLASSES && std::getline(is, item, ','); ++count) {
+      parsed[count] = atoi(item.c_str());
+      if (parsed[count] <= 0) {
+        return false;
+      }
+    }
+    std::copy(parsed, parsed + count, weights);
+    return true;
+  }
+
+  bool   empty() const { return queued_ == 0; }
+  size_t queued() const { return queued_; }
+
+  void push(int cls, frame_type type, int sid, const unsigned char *buffer, int size) {
+    auto &q = queues_[cls];
+
+    unsigned char head[HEAD_SIZE];
+    head[0] = (unsigned char)type;
+    memcpy(head + 1, &sid, sizeof(sid));
+    memcpy(head + 5, &size, sizeof(size));
+    q.bytes.insert(q.bytes.end(), head, head + HEAD_SIZE);
+    if (size > 0) {
+      q.bytes.insert(q.bytes.end(), buffer, buffer + size);
+    }
+    q.frames++;
+    queued_++;
+  }
+
+  /**
+   * Hands queued frames to send(type, sid, buffer, size) while admit() allows, an interrupted
+   * round resumes where it stopped on the next call.
+   */
+  template<typename Admit, typename Send>
+  void drain(const config &cfg, int quantum, Admit admit, Send send) {
+    if (cfg.mode != WEIGHTED) {
+      for (int cls = 0; cls < CLASSES; ++cls) {
+        while (!queues_[cls].empty() && admit()) {
+          pop(cls, send);
+        }
+      }
+      return;
+    }
+    int idle = 0;
+    while (idle < CLASSES && admit()) {
+      auto &q = queues_[current_];
+      if (q.empty()) {
+        deficit_[current_] = 0;
+        next();
+        idle++;
+        continue;
+      }
+      idle = 0;
+      if (!credited_) {
+        deficit_[current_] += cfg.weights[current_] * quantum;
+        credited_ = true;
+      }
+      while (!q.empty() && q.front_size() <= deficit_[current_] && admit()) {
+        deficit_[current_] -= q.front_size();
+        pop(current_, send);
+      }
+      if (q.empty()) {
+        deficit_[current_] = 0;
+        next();
+      } else if (q.front_size() > deficit_[current_]) {
+        next();
+      }
+    }
+  }
+
+private:
+  constexpr static int HEAD_SIZE = 9;  // type, sid, size of a queued frame
+
+  struct queue {
+    std::vector<unsigned char> bytes;
+    size_t                     head{0};
+    size_t                     frames{0};
+
+    bool empty() const { return frames == 0; }
+    int  front_size() const {
+      int size;
+      memcpy(&size, bytes.data() + head + 5, sizeof(size));
+      return size;
+    }
+  };
+
+  template<typename Send>
+  void pop(int cls, Send &send) {
+    auto &         q = queues_[cls];
+    unsigned char *p = q.bytes.data() + q.head;
+    int            sid, size;
+    memcpy(&sid, p + 1, sizeof(sid));
+    memcpy(&size, p + 5, sizeof(size));
+    q.head += HEAD_SIZE + size;
+    q.frames--;
+    queued_--;
+    send((frame_type)p[0], sid, p + HEAD_SIZE, size);
+    if (q.frames == 0) {
+      q.bytes.clear();
+      q.head = 0;
+    } else if (q.head > SIZE_4M / 16 && q.head * 2 > q.bytes.size()) {
+      // Keep a long backlog from growing the buffer without bound
+      q.bytes.erase(q.bytes.begin(), q.bytes.begin() + q.head);
+      q.head = 0;
+    }
+  }
+
+  void next() {
+    current_  = (current_ + 1) % CLASSES;
+    credited_ = false;
+  }
+
+  queue  queues_[CLASSES];
+  size_t queued_{0};
+  int    deficit_[CLASSES]{};
+  int    current_{0};
+  bool   credited_{false};
+};
+
+/**
+ * Picks the class of a stream by the first matching rule of a comma separated list:
+ *
+ *   port:22=0, port:6000-6100=1, cidr:10.0.0.0/8=1, dscp:46=0
+ *
+ * Ports and networks match the CONNECT target, domains are not resolved on the client so they
+ * only match port rules. DSCP is taken from the SYN of the local connection.
+ */
+class priority_rules {
+public:
+  bool empty() const { return rules_.empty(); }
+  bool uses_dscp() const { return uses_dscp_; }
+
+  /** Malformed rules are logged and skipped, returns false if there were any */
+  bool parse(const std::string &text) {
+    std::istringstream is(text);
+    std::string        item;
+    bool               ok = true;
+    while (std::getline(is, item, ',')) {
+      item.erase(0, item.find_first_not_of(" \t"));
+      item.erase(item.find_last_not_of(" \t") + 1);
+      if (item.empty()) {
+        continue;
+      }
+      rule r{};
+      if (!parse_rule(item, &r)) {
+        LOG_WARN << "skip malformed priority rule [" << item << "]";
+        ok = false;
+        continue;
+      }
+      uses_dscp_ = uses_dscp_ || r.type == DSCP;
+      rules_.push_back(r);
+    }
+    return ok;
+  }
+
+  /** request is the socks5 CONNECT, dscp is -1 if unknown */
+  int classify(const unsigned char *request, int size, int dscp) const {
+    int      port   = 0;
+    endpoint target = socks5::peek_target(request, size, &port);
+    for (auto &r : rules_) {
+      switch (r.type) {
+        case PORT:
+          if (port >= r.lo && port <= r.hi) {
+            return r.cls;
+          }
+          break;
+        case CIDR:
+          if (in_network(target, r)) {
+            return r.cls;
+          }
+          break;
+        case DSCP:
+          if (dscp == r.lo) {
+            return r.cls;
+          }
+          break;
+      }
+    }
+    return frame_scheduler::DEFAULT_CLASS;
+  }
+
+private:
+  enum rule_type : int { PORT, CIDR, DSCP };
+
+  struct rule {
+    rule_type type;
+    int       lo;  // port range or dscp, prefix length of a network
+    int       hi;
+    endpoint  network;
+    int       cls;
+  };
+
+  static bool parse_rule(const std::string &item, rule *r) {
+    size_t colon = item.find(':');
+    size_t equal = item.rfind('=');
+    if (colon == std::string::npos || equal == std::string::npos || equal < colon) {
+      return false;
+    }
+    std::string name  = item.substr(0, colon);
+    std::string match = item.substr(colon + 1, equal - colon - 1);
+    r->cls            = atoi(item.c_str() + equal + 1);
+    if (r->cls < 0 || r->cls >= frame_scheduler::CLASSES) {
+      return false;
+    }
+    if (name == "port") {
+      r->type    = PORT;
+      size_t sep = match.find('-');
+      r->lo      = atoi(match.c_str());
+      r->hi      = sep == std::string::npos ? r->lo : atoi(match.c_str() + sep + 1);
+      return r->lo > 0 && r->hi >= r->lo && r->hi <= 65535;
+    }
+    if (name == "dscp") {
+      r->type = DSCP;
+      r->lo   = atoi(match.c_str());
+      return r->lo >= 0 && r->lo < 64;
+    }
+    if (name == "cidr") {
+      r->type      = CIDR;
+      size_t slash = match.find('/');
+      if (slash == std::string::npos) {
+        return false;
+      }
+      std::string   host = match.substr(0, slash);
+      unsigned char addr[16];
+      int           family = host.find(':') == std::string::npos ? AF_INET : AF_INET6;
+      if (inet_pton(family, host.c_str(), addr) != 1) {
+        return false;
+      }
+      r->network = endpoint::from_bytes(family, addr, 0);
+      r->lo      = atoi(match.c_str() + slash + 1);
+      return r->lo >= 0 && r->lo <= (family == AF_INET6 ? 128 : 32);
+    }
+    return false;
+  }
+
+  static bool in_network(const endpoint &target, const rule &r) {
+    if (target.is_null() || target.family() != r.network.family()) {
+      return false;
+    }
+    auto *a    = static_cast<const unsigned char *>(target.bytes());
+    auto *b    = static_cast<const unsigned char *>(r.network.bytes());
+    int   bits = r.lo;
+    for (int i = 0; bits > 0; ++i, bits -= 8) {
+      unsigned char mask = bits >= 8 ? 0xFFU : (unsigned char)(0xFFU << (8 - bits));
+      if ((a[i] & mask) != (b[i] & mask)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  std::vector<rule> rules_;
+  bool              uses_dscp_{false};
+};
+
+#endif  // KCPSS_PRIORITY_H
@@ -33,6 +33,11 @@
 #include <sys/types.h>
 
 #include <set>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <algorithm>
+#include <type_traits>
 #include <vector>
 #include <functional>
 #include <fstream>
@@ -40,6 +45,7 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <cerrno>
+#include <cstring>
 #include <random>
 
 #include <ev.h>
@@ -0,0 +1,159 @@
+// MIT License
+//
+// Copyright (c) 2020 Gui Yang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef KCPSS_SESSION_TABLE_H
+#define KCPSS_SESSION_TABLE_H
+
+#include "public.h"
+#include "socket.h"
+
+struct session;
+
+/** Everything the per packet path of udp_server needs to know about a conv. */
+struct session_record {
+  uint32_t    conv;
+  session *   s;     // nullptr marks a free slot
+  endpoint    peer;  // Where the last datagram came from, replies go there
+  uint32_t    rx_packets;
+  uint32_t    tx_packets;
+  uint64_t    rx_bytes;
+  uint64_t    tx_bytes;
+
+  bool from(const endpoint &addr) const { return peer == addr; }
+};
+
+/**
+ * Open addressing table of session records keyed by conv.
+ *
+ * Linear probing over a power of two array kept at most half full, erase shifts the
+ * following records back so lookups never walk over tombstones.
+ */
+class session_table {
+public:
+  explicit session_table(size_t capacity = 64) : size_(0) { slots_.resize(round_up(capacity)); }
+
+  size_t size() const { return size_; }
+
+  session_record *find(uint32_t conv) {
+    size_t mask = slots_.size() - 1;
+    for (size_t i = index(conv);; i = (i + 1) & mask) {
+      auto &slot = slots_[i];
+      if (slot.s == nullptr) {
+        return nullptr;
+      }
+      if (slot.conv == conv) {
+        return &slot;
+      }
+    }
+  }
+
+  /** Cold path, only used when a conv shows up for the first time. */
+  session_record *find_peer(const endpoint &addr) {
+    for (auto &slot : slots_) {
+      if (slot.s != nullptr && slot.from(addr)) {
+        return &slot;
+      }
+    }
+    return nullptr;
+  }
+
+  session_record *insert(uint32_t conv, session *s, const endpoint &peer) {
+    if ((size_ + 1) * 2 > slots_.size()) {
+      rehash(slots_.size() * 2);
+    }
+    size_t mask = slots_.size() - 1;
+    size_t i    = index(conv);
+    while (slots_[i].s != nullptr && slots_[i].conv != conv) {
+      i = (i + 1) & mask;
+    }
+    auto &slot = slots_[i];
+    if (slot.s == nullptr) {
+      ++size_;
+    }
+    slot      = session_record{};
+    slot.conv = conv;
+    slot.s    = s;
+    slot.peer = peer;
+    return &slot;
+  }
+
+  bool erase(uint32_t conv) {
+    auto *slot = find(conv);
+    if (slot == nullptr) {
+      return false;
+    }
+    size_t mask = slots_.size() - 1;
+    size_t hole = slot - slots_.data();
+    for (size_t i = (hole + 1) & mask; slots_[i].s != nullptr; i = (i + 1) & mask) {
+      // Move back every record whose home slot is not between the hole and itself
+      size_t home = index(slots_[i].conv);
+      if (((i - home) & mask) >= ((i - hole) & mask)) {
+        slots_[hole] = slots_[i];
+        hole         = i;
+      }
+    }
+    slots_[hole] = session_record{};
+    --size_;
+    return true;
+  }
+
+  /** Visits the records from slot start on, wrapping around, so a moving start rotates the order */
+  template<typename F>
+  void for_each(F &&f, size_t start = 0) {
+    size_t mask = slots_.size() - 1;
+    for (size_t n = 0, i = start & mask; n < slots_.size(); ++n, i = (i + 1) & mask) {
+      if (slots_[i].s != nullptr) {
+        f(slots_[i]);
+      }
+    }
+  }
+
+private:
+  static size_t round_up(size_t n) {
+    size_t capacity = 16;
+    while (capacity < n) {
+      capacity <<= 1U;
+    }
+    return capacity;
+  }
+
+  size_t index(uint32_t conv) const {
+    // Fibonacci hashing, convs of clients are random but the ones of tests are not
+    return (size_t)((conv * 0x9E3779B97F4A7C15ULL) >> 32U) & (slots_.size() - 1);
+  }
+
+  void rehash(size_t capacity) {
+    std::vector<session_record> old(capacity);
+    old.swap(slots_);
+    size_ = 0;
+    for (auto &slot : old) {
+      if (slot.s != nullptr) {
+        *insert(slot.conv, slot.s, slot.peer) = slot;
+      }
+    }
+  }
+
+  std::vector<session_record> slots_;
+  size_t                      size_;
+};
+
+#endif  // KCPSS_SESSION_TABLE_H
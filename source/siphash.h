@@ -0,0 +1,128 @@
+// MIT License
+//
+// Copyright (c) 2020 Gui Yang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef KCPSS_SIPHASH_H
+#define KCPSS_SIPHASH_H
+
+#include "public.h"
+
+/**
+ * SipHash-2-4 keyed with a shared secret, used to tag datagrams on the wire.
+ *
+ * Four bytes of the digest are appended to every datagram and checked before anything else
+ * looks at it, so garbage and spoofed packets are dropped without touching session state.
+ */
+class siphash {
+public:
+  constexpr static int TAG_SIZE = 4;
+
+  siphash(uint64_t k0 = 0, uint64_t k1 = 0) : k0_(k0), k1_(k1) {}
+
+  /** Derives the 128 bit key from a configured passphrase. */
+  static siphash from_string(const std::string &secret) {
+    siphash seed;
+    return siphash(seed(secret.data(), secret.size()),
+                   seed.with_key(0x6b637073ULL, 0x73736b63ULL)(secret.data(), secret.size()));
+  }
+
+  siphash with_key(uint64_t k0, uint64_t k1) const { return siphash(k0_ ^ k0, k1_ ^ k1); }
+
+  uint64_t operator()(const void *data, size_t size) const {
+    auto *   in = static_cast<const unsigned char *>(data);
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0_;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1_;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0_;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1_;
+
+    const unsigned char *end = in + (size & ~size_t(7));
+    for (; in != end; in += 8) {
+      uint64_t m = load64(in);
+      v3 ^= m;
+      round(v0, v1, v2, v3);
+      round(v0, v1, v2, v3);
+      v0 ^= m;
+    }
+    uint64_t b = static_cast<uint64_t>(size) << 56U;
+    for (size_t i = 0; i < (size & 7U); ++i) {
+      b |= static_cast<uint64_t>(in[i]) << (8U * i);
+    }
+    v3 ^= b;
+    round(v0, v1, v2, v3);
+    round(v0, v1, v2, v3);
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    for (int i = 0; i < 4; ++i) {
+      round(v0, v1, v2, v3);
+    }
+    return v0 ^ v1 ^ v2 ^ v3;
+  }
+
+  /** Writes the tag of data into tag, TAG_SIZE bytes. */
+  void sign(const void *data, size_t size, unsigned char *tag) const {
+    auto digest = static_cast<uint32_t>((*this)(data, size));
+    memcpy(tag, &digest, TAG_SIZE);
+  }
+
+  /** Returns true when the last TAG_SIZE bytes of data are its tag. */
+  bool verify(const void *data, size_t size) const {
+    if (size < TAG_SIZE) {
+      return false;
+    }
+    unsigned char tag[TAG_SIZE];
+    sign(data, size - TAG_SIZE, tag);
+    return memcmp(tag, static_cast<const unsigned char *>(data) + size - TAG_SIZE, TAG_SIZE) == 0;
+  }
+
+private:
+  static uint64_t rotl(uint64_t x, int b) { return (x << b) | (x >> (64 - b)); }
+
+  static uint64_t load64(const unsigned char *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i) {
+      v |= static_cast<uint64_t>(p[i]) << (8U * i);
+    }
+    return v;
+  }
+
+  static void round(uint64_t &v0, uint64_t &v1, uint64_t &v2, uint64_t &v3) {
+    v0 += v1;
+    v1 = rotl(v1, 13);
+    v1 ^= v0;
+    v0 = rotl(v0, 32);
+    v2 += v3;
+    v3 = rotl(v3, 16);
+    v3 ^= v2;
+    v0 += v3;
+    v3 = rotl(v3, 21);
+    v3 ^= v0;
+    v2 += v1;
+    v1 = rotl(v1, 17);
+    v1 ^= v2;
+    v2 = rotl(v2, 32);
+  }
+
+  uint64_t k0_;
+  uint64_t k1_;
+};
+
+#endif  // KCPSS_SIPHASH_H
@@ -0,0 +1,106 @@
+// MIT License
+//
+// Copyright (c) 2020 Gui Yang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef KCPSS_SLOT_MAP_H
+#define KCPSS_SLOT_MAP_H
+
+#include "public.h"
+
+/**
+ * Dense array of values addressed by handles that pack (generation, index).
+ *
+ * Erasing a value bumps the generation of its slot before the slot is reused, so a stale
+ * handle misses in O(1) instead of reaching whatever took its place. Handle 0 is never issued.
+ */
+template<typename T>
+class slot_map {
+public:
+  using handle = uint64_t;
+
+  handle insert(const T &value) {
+    uint32_t index;
+    if (!free_.empty()) {
+      index = free_.back();
+      free_.pop_back();
+    } else {
+      index = (uint32_t)slots_.size();
+      slots_.push_back(slot{});
+    }
+    auto &slot = slots_[index];
+    slot.value = value;
+    slot.used  = true;
+    ++size_;
+    return (uint64_t)slot.generation << 32U | index;
+  }
+
+  T *get(handle h) {
+    uint32_t index = (uint32_t)h;
+    if (index >= slots_.size()) {
+      return nullptr;
+    }
+    auto &slot = slots_[index];
+    return slot.used && slot.generation == (uint32_t)(h >> 32U) ? &slot.value : nullptr;
+  }
+
+  bool erase(handle h) {
+    if (get(h) == nullptr) {
+      return false;
+    }
+    auto &slot = slots_[(uint32_t)h];
+    slot.value = T{};
+    slot.used  = false;
+    // Generation 0 is skipped so no handle ever equals 0
+    if (++slot.generation == 0) {
+      slot.generation = 1;
+    }
+    free_.push_back((uint32_t)h);
+    --size_;
+    return true;
+  }
+
+  size_t size() const { return size_; }
+
+  // Visits copies of the values in slot order, f may insert, values erased before their turn are
+  // skipped
+  template<typename F>
+  void for_each(F f) {
+    for (size_t i = 0; i < slots_.size(); ++i) {
+      if (slots_[i].used) {
+        T value = slots_[i].value;
+        f(value);
+      }
+    }
+  }
+
+private:
+  struct slot {
+    T        value{};
+    uint32_t generation{1};
+    bool     used{false};
+  };
+
+  std::vector<slot>     slots_;
+  std::vector<uint32_t> free_;
+  size_t                size_{0};
+};
+
+#endif  // KCPSS_SLOT_MAP_H
@@ -25,83 +25,173 @@
 
 #include "public.h"
 
+#ifdef __linux__
+#ifndef SO_ORIGINAL_DST
+#define SO_ORIGINAL_DST 80  // linux/netfilter_ipv4.h, the same value for IPv6
+#endif
+#endif
+
+/**
+ * IPv4 or IPv6 socket address, trivially copyable and allocation free.
+ *
+ * Only the sockaddr is stored, the text form is produced on demand when an endpoint is
+ * logged, so endpoints can be copied, compared and hashed on every datagram.
+ */
 class endpoint {
 public:
-  endpoint() : port_(0) { memset(&sockaddr_, 0, sizeof(struct sockaddr_in)); }
-  endpoint(const char *path) : path_(path) {
-    char         type[32]  = {0};
-    char         host[256] = {0};
-    unsigned int port      = 0;
+  endpoint() { memset(&addr_, 0, sizeof(addr_)); }
 
-    /** addr is protocol://ip:port */
-    sscanf(path, "%31[^:]://%[^:]:%u", type, host, &port);
-    port_ = (int)port;
-    host_ = host;
-    memset(&sockaddr_, 0, sizeof(struct sockaddr_in));
-    sockaddr_.sin_family      = AF_INET;
-    sockaddr_.sin_port        = htons(port);
-    sockaddr_.sin_addr.s_addr = inet_addr(host);
+  /** path is protocol://ip:port, IPv6 addresses go in brackets, protocol://[::1]:port */
+  explicit endpoint(const char *path) : endpoint() {
+    const char *host = strstr(path, "://");
+    host             = host ? host + 3 : path;
+    const char *colon;
+    char        ip[INET6_ADDRSTRLEN] = {0};
+    if (*host == '[') {
+      const char *close = strchr(host, ']');
+      colon             = close ? strchr(close, ':') : nullptr;
+      copy_host(ip, sizeof(ip), host + 1, close);
+    } else {
+      colon = strrchr(host, ':');
+      copy_host(ip, sizeof(ip), host, colon);
+    }
+    assign(ip, colon ? atoi(colon + 1) : 0);
   }
 
-  endpoint(struct sockaddr_in addr) : port_(addr.sin_port), host_(inet_ntoa(addr.sin_addr)) {
-    memcpy(&sockaddr_, &addr, sizeof(sockaddr_in));
+  endpoint(const char *prorocol, const char *ip, int port) : endpoint() { assign(ip, port); }
+
+  endpoint(const struct sockaddr_in &addr) : endpoint() { addr_.v4 = addr; }
+
+  endpoint(const struct sockaddr_in6 &addr) : endpoint() { addr_.v6 = addr; }
+
+  endpoint(const struct sockaddr *addr, socklen_t len) : endpoint() {
+    memcpy(&addr_, addr, std::min<size_t>(len, sizeof(addr_)));
   }
 
-  endpoint(const char *prorocol, const char *ip, int port) : port_(port), host_(ip) {
-    memset(&sockaddr_, 0, sizeof(struct sockaddr_in));
-    sockaddr_.sin_family      = AF_INET;
-    sockaddr_.sin_port        = htons(port);
-    sockaddr_.sin_addr.s_addr = inet_addr(ip);
+  /** Builds an endpoint from raw network order address bytes, as found in socks5 requests */
+  static endpoint from_bytes(int family, const void *bytes, int port) {
+    endpoint ep;
+    if (family == AF_INET) {
+      ep.addr_.v4.sin_family = AF_INET;
+      memcpy(&ep.addr_.v4.sin_addr, bytes, sizeof(in_addr));
+    } else if (family == AF_INET6) {
+      ep.addr_.v6.sin6_family = AF_INET6;
+      memcpy(&ep.addr_.v6.sin6_addr, bytes, sizeof(in6_addr));
+    }
+    ep.port(port);
+    return ep;
   }
 
-  endpoint(const endpoint &other) : port_(other.port_), path_(other.path_), host_(other.host_) {
-    memcpy(&sockaddr_, &other.sockaddr_, sizeof(sockaddr_));
+  bool operator==(const endpoint &other) const {
+    if (family() != other.family()) {
+      return false;
+    }
+    if (family() == AF_INET) {
+      return addr_.v4.sin_port == other.addr_.v4.sin_port &&
+             addr_.v4.sin_addr.s_addr == other.addr_.v4.sin_addr.s_addr;
+    }
+    return addr_.v6.sin6_port == other.addr_.v6.sin6_port &&
+           memcmp(&addr_.v6.sin6_addr, &other.addr_.v6.sin6_addr, sizeof(in6_addr)) == 0;
   }
 
-  endpoint &operator=(const endpoint &other) {
-    port_ = other.port_;
-    path_ = other.path_;
-    host_ = other.host_;
-    memcpy(&sockaddr_, &other.sockaddr_, sizeof(sockaddr_));
+  bool operator!=(const endpoint &other) const { return !(*this == other); }
 
-    return *this;
+  /** Same address, whatever the ports */
+  bool same_host(const endpoint &other) const {
+    size_t len = family() == AF_INET6 ? sizeof(in6_addr) : sizeof(in_addr);
+    return family() == other.family() && memcmp(bytes(), other.bytes(), len) == 0;
   }
 
-  bool operator==(const endpoint &other) const {
-    return memcmp(&sockaddr_, &other.sockaddr_, sizeof(sockaddr_)) == 0;
-  }
+  int family() const { return addr_.sa.sa_family; }
 
-  int port() const { return port_; }
+  int port() const { return ntohs(addr_.v4.sin_port); }  // Same offset in sockaddr_in6
 
   int port(int port) {
-    sockaddr_.sin_port = htons(port);
-    return port_       = port;
+    addr_.v4.sin_port = htons(port);
+    return port;
   }
 
-  const char *host() const { return host_.c_str(); }
+  /** Network order address bytes, 4 or 16 of them, the counterpart of from_bytes */
+  const void *bytes() const {
+    return family() == AF_INET6 ? (const void *)&addr_.v6.sin6_addr
+                                : (const void *)&addr_.v4.sin_addr;
+  }
+
+  std::string host() const {
+    char text[INET6_ADDRSTRLEN] = {0};
+    inet_ntop(family() == AF_INET6 ? AF_INET6 : AF_INET, bytes(), text, sizeof(text));
+    return text;
+  }
 
-  const sockaddr_in *sockaddr() const { return &sockaddr_; }
+  const struct sockaddr *sockaddr() const { return &addr_.sa; }
+  struct sockaddr *      sockaddr() { return &addr_.sa; }
+  socklen_t size() const { return family() == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in); }
+  static socklen_t capacity() { return sizeof(addr_); }
+
+  size_t hash() const {
+    uint64_t h = (uint64_t)addr_.v4.sin_port << 48U | (uint64_t)family() << 32U;
+    if (family() == AF_INET6) {
+      uint64_t words[2];
+      memcpy(words, &addr_.v6.sin6_addr, sizeof(words));
+      h ^= words[0] * 0x9E3779B97F4A7C15ULL ^ words[1];
+    } else {
+      h ^= addr_.v4.sin_addr.s_addr;
+    }
+    return (size_t)(h * 0xFF51AFD7ED558CCDULL >> 16U);
+  }
 
-  static endpoint null() { return endpoint("", "", -1); }
-  bool            is_null() { return port_ == -1 && host_.empty(); }
+  static endpoint null() { return endpoint(); }
+  bool            is_null() const { return family() == AF_UNSPEC; }
 
 private:
-  int                port_;
-  std::string        host_;
-  std::string        path_;
-  struct sockaddr_in sockaddr_ {};
+  static void copy_host(char *dst, size_t size, const char *begin, const char *end) {
+    size_t len = end ? (size_t)(end - begin) : strlen(begin);
+    len        = std::min(len, size - 1);
+    memcpy(dst, begin, len);
+    dst[len] = 0;
+  }
+
+  void assign(const char *ip, int port) {
+    if (inet_pton(AF_INET6, ip, &addr_.v6.sin6_addr) == 1) {
+      addr_.v6.sin6_family = AF_INET6;
+    } else if (*ip == 0 || inet_pton(AF_INET, ip, &addr_.v4.sin_addr) == 1) {
+      addr_.v4.sin_family = AF_INET;
+    } else {
+      struct addrinfo  hints {};
+      struct addrinfo *result = nullptr;
+      hints.ai_family         = AF_UNSPEC;
+      if (getaddrinfo(ip, nullptr, &hints, &result) != 0 || result == nullptr) {
+        return;  // Unknown host, stays null
+      }
+      memcpy(&addr_, result->ai_addr, std::min<size_t>(result->ai_addrlen, sizeof(addr_)));
+      freeaddrinfo(result);
+    }
+    this->port(port);
+  }
+
+  union {
+    struct sockaddr     sa;
+    struct sockaddr_in  v4;
+    struct sockaddr_in6 v6;
+  } addr_;
 };
 
+static_assert(std::is_trivially_copyable<endpoint>::value, "endpoint is copied per datagram");
+
 template<typename STREAM>
 inline STREAM &operator<<(STREAM &s, const endpoint &ep) {
-  s << "=>" << ep.host() << ":" << ep.port();
+  if (ep.family() == AF_INET6) {
+    s << "[" << ep.host() << "]:" << ep.port();
+  } else {
+    s << ep.host() << ":" << ep.port();
+  }
   return s;
 }
 
 class socket {
 public:
   static int create_udp(const endpoint &ep) {
-    int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+    int fd = ::socket(ep.family() == AF_INET6 ? AF_INET6 : AF_INET, SOCK_DGRAM, 0);
     if (fd < 0) {
       LOG_CRIT << "socket creation failed, please check maximum fd size";
       exit(0);
@@ -116,12 +206,7 @@ public:
     setsockopt(fd, IPPROTO_IP, IP_TOS, &iptos, sizeof(iptos));
 
     if (ep.port() != 0) {
-      struct sockaddr_in srv_addr {};
-      memset(&srv_addr, 0, sizeof(struct sockaddr_in));
-      srv_addr.sin_family      = AF_INET;
-      srv_addr.sin_port        = htons(ep.port());
-      srv_addr.sin_addr.s_addr = inet_addr(ep.host());
-      if (::bind(fd, (struct sockaddr *)&srv_addr, sizeof(srv_addr)) < 0) {
+      if (::bind(fd, ep.sockaddr(), ep.size()) < 0) {
         LOG_CRIT << "udp can not bind to port " << ep.port();
         exit(1);
       }
@@ -129,14 +214,39 @@ public:
     return fd;
   }
 
-  static int create_tcp(const endpoint &ep) {
-    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  /**
+   * Sends of a udp socket carry DF and ignore the cached path mtu while probing, otherwise
+   * they follow it. An IPv6 socket also sends to IPv4 mapped peers, both levels are set.
+   */
+  static void probe_path(int fd, int family, bool probing) {
+#if defined(IPV6_MTU_DISCOVER) && defined(IPV6_PMTUDISC_PROBE)
+    if (family == AF_INET6) {
+      int val = probing ? IPV6_PMTUDISC_PROBE : IPV6_PMTUDISC_WANT;
+      setsockopt(fd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &val, sizeof(val));
+    }
+#elif defined(IPV6_DONTFRAG)
+    if (family == AF_INET6) {
+      int val = probing ? 1 : 0;
+      setsockopt(fd, IPPROTO_IPV6, IPV6_DONTFRAG, &val, sizeof(val));
+    }
+#endif
+#if defined(IP_MTU_DISCOVER)
+    int val = probing ? IP_PMTUDISC_PROBE : IP_PMTUDISC_WANT;
+    setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val));
+#elif defined(IP_DONTFRAG)
+    int val = probing ? 1 : 0;
+    setsockopt(fd, IPPROTO_IP, IP_DONTFRAG, &val, sizeof(val));
+#endif
+  }
+
+  // With deferred set the connect may be held back until the first send, see Channel::fast_open
+  static int create_tcp(const endpoint &ep, bool *deferred = nullptr) {
+    int fd = ::socket(ep.family() == AF_INET6 ? AF_INET6 : AF_INET, SOCK_STREAM, 0);
     if (fd == -1) {
       LOG_CRIT << "socket creation failed";
       exit(0);
     } else {
-      LOG_INFO << "socket successfully created, fd=" << fd << ", connect to " << ep.host() << ":"
-               << ep.port();
+      LOG_INFO << "socket successfully created, fd=" << fd << ", connect to " << ep;
       int flag    = 1;
       int bufsize = SIZE_16M;
       setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
@@ -146,33 +256,95 @@ public:
       int flags = fcntl(fd, F_GETFL, 0);
       fcntl(fd, F_SETFL, flags | O_NONBLOCK);
     }
+    bool fast_open = false;
+#ifdef TCP_FASTOPEN_CONNECT
+    if (deferred) {
+      int flag  = 1;
+      fast_open = setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &flag, sizeof(flag)) == 0;
+    }
+#endif
 
-    int res = ::connect(fd, reinterpret_cast<const sockaddr *>(ep.sockaddr()), sizeof(sockaddr_in));
+    int res = ::connect(fd, ep.sockaddr(), ep.size());
     if (res < 0 && errno != EINPROGRESS) {
-      LOG_WARN << "connection with the remote server failed: " << ep.host() << ":" << ep.port();
+      LOG_WARN << "connection with the remote server failed: " << ep;
       return fd;
     }
 
-    if (res == 0) {
-      LOG_INFO << "connected to the server, fd[" << fd << "]" << ep.host() << ":" << ep.port();
+    if (res == 0 && fast_open) {
+      // A cookie is cached for the peer, the SYN waits to carry the first payload
+      LOG_INFO << "fd[" << fd << "] connect " << ep << " deferred to the first send";
+      *deferred = true;
+    } else if (res == 0) {
+      LOG_INFO << "connected to the server, fd[" << fd << "]" << ep;
     } else {  // connection attempt is in progress
-      LOG_INFO << "fd[" << fd << "] connect " << ep.host() << ":" << ep.port() << " in processing";
+      LOG_INFO << "fd[" << fd << "] connect " << ep << " in processing";
     }
     return fd;
   }
+
+  /**
+   * Where a connection redirected to the listener on listen_port was heading, null for one
+   * made to the listener itself. iptables REDIRECT keeps it in conntrack, TPROXY leaves it
+   * as the local address of the socket.
+   */
+  static endpoint original_destination(int fd, int listen_port) {
+    endpoint  local;
+    socklen_t len = endpoint::capacity();
+    if (getsockname(fd, local.sockaddr(), &len) < 0) {
+      return endpoint::null();
+    }
+#ifdef __linux__
+    endpoint target;
+    len       = endpoint::capacity();
+    int level = local.family() == AF_INET6 ? IPPROTO_IPV6 : IPPROTO_IP;
+    if (getsockopt(fd, level, SO_ORIGINAL_DST, target.sockaddr(), &len) == 0) {
+      return target == local ? endpoint::null() : target;
+    }
+#endif
+    return local.port() == listen_port ? endpoint::null() : local;
+  }
+
+  /** Remote end of a connected socket, null if it has none */
+  static endpoint peer(int fd) {
+    endpoint  remote;
+    socklen_t len = endpoint::capacity();
+    return getpeername(fd, remote.sockaddr(), &len) == 0 ? remote : endpoint::null();
+  }
+
+  /** DSCP the peer marked the SYN of an accepted IPv4 connection with, -1 if unknown */
+  static int received_dscp(int fd) {
+#if defined(IP_PKTOPTIONS) && defined(IP_RECVTOS)
+    int on = 1;
+    if (setsockopt(fd, IPPROTO_IP, IP_RECVTOS, &on, sizeof(on)) < 0) {
+      return -1;
+    }
+    union {
+      struct cmsghdr align;
+      unsigned char  data[CMSG_SPACE(sizeof(int))];
+    } control{};
+    socklen_t len = sizeof(control);
+    if (getsockopt(fd, IPPROTO_IP, IP_PKTOPTIONS, &control, &len) < 0) {
+      return -1;
+    }
+    struct msghdr msg {};
+    msg.msg_control    = &control;
+    msg.msg_controllen = len;
+    for (auto *c = CMSG_FIRSTHDR(&msg); c != nullptr; c = CMSG_NXTHDR(&msg, c)) {
+      if (c->cmsg_level == IPPROTO_IP && c->cmsg_type == IP_TOS) {
+        // Older kernels pass the tos as a byte, newer ones as an int
+        int tos = c->cmsg_len >= CMSG_LEN(sizeof(int)) ? *(int *)CMSG_DATA(c) : *CMSG_DATA(c);
+        return (tos & 0xFF) >> 2;
+      }
+    }
+#endif
+    return -1;
+  }
 };
 namespace std {
 
 template<>
 struct hash<endpoint> {
-  std::size_t operator()(const endpoint &key) const {
-    in_addr  addr   = key.sockaddr()->sin_addr;
-    uint32_t port   = key.port();
-    uint64_t unique = *(uint32_t *)(&addr);
-    unique          = (unique << 32) | port;
-
-    return std::hash<uint64_t>()(unique);
-  }
+  std::size_t operator()(const endpoint &key) const { return key.hash(); }
 };
 
 }  // namespace std
@@ -24,6 +24,11 @@
 
 class socks5 {
 public:
+  constexpr static uint8_t CMD_CONNECT       = 1;
+  constexpr static uint8_t CMD_UDP_ASSOCIATE = 3;
+  constexpr static int     REQUEST_HEADER    = 3;  // VER CMD RSV before the address
+  constexpr static int     UDP_HEADER_SIZE   = 3;  // RSV(2) FRAG(1) before the address
+
   static bool is_hello(const unsigned char *buffer, int size) {
     return size == 3 && buffer[0] == 5 && buffer[1] == 1;
   }
@@ -33,34 +38,103 @@ public:
     *size     = 2;
   }
 
+  /** Size of the CONNECT request at the head of buffer, 0 if it is truncated or another command. */
+  static int connect_request_size(const unsigned char *buffer, int size) {
+    return command(buffer, size) == CMD_CONNECT ? request_size(buffer, size) : 0;
+  }
+
+  /** Size of the UDP ASSOCIATE request at the head of buffer, 0 if it is truncated or another. */
+  static int associate_request_size(const unsigned char *buffer, int size) {
+    return command(buffer, size) == CMD_UDP_ASSOCIATE ? request_size(buffer, size) : 0;
+  }
+
+  static bool is_associate(const unsigned char *buffer, int size) {
+    return associate_request_size(buffer, size) > 0;
+  }
+
   static endpoint parser_endpoint_from_request(unsigned char *buffer, int size) {
-    auto *header = reinterpret_cast<socks5_header *>(buffer);
-    if (header->cmd != 1) {
+    endpoint target;
+    if (command(buffer, size) != CMD_CONNECT ||
+        parse_address(buffer + REQUEST_HEADER, size - REQUEST_HEADER, &target) == 0) {
+      return endpoint::null();
+    }
+    return target;
+  }
+
+  /** Target of a CONNECT request without resolving it, null for a domain, and its port */
+  static endpoint peek_target(const unsigned char *buffer, int size, int *port) {
+    *port = 0;
+    if (connect_request_size(buffer, size) == 0) {
       return endpoint::null();
     }
-    char *          ip   = header->addr + 1;
-    uint8_t         high = *(uint8_t *)(buffer + size - 2);
-    uint8_t         low  = *(uint8_t *)(buffer + size - 1);
-    int             port = high << 8 | low;
-    struct hostent *host;
-    switch (header->addr_type) {
+    const unsigned char *addr = buffer + REQUEST_HEADER;
+    *port                     = read_port(addr + address_size(addr, size - REQUEST_HEADER) - 2);
+    if (addr[0] == 3) {
+      return endpoint::null();
+    }
+    return endpoint::from_bytes(addr[0] == 1 ? AF_INET : AF_INET6, addr + 1, *port);
+  }
+
+  /**
+   * Parses ATYP, DST.ADDR and DST.PORT as found in requests and udp datagrams, returns the
+   * bytes consumed or 0 if the address is truncated or of an unknown type. Unknown hosts
+   * come back null.
+   */
+  static int parse_address(const unsigned char *buffer, int size, endpoint *target) {
+    if (size < 1) {
+      return 0;
+    }
+    const unsigned char *addr = buffer + 1;
+    int                  left = size - 1;
+    switch (buffer[0]) {
       case 1:  // ipv4
-        break;
-      case 3:  // domain
-        *(uint8_t *)(buffer + size - 2) = 0;
-        host                            = gethostbyname(ip);
-        if (host == nullptr) {  // unknown host
-          return endpoint::null();
+        if (left < 4 + 2) {
+          return 0;
         }
-        ip = inet_ntoa(*(struct in_addr *)((host)->h_addr_list[0]));
-        break;
+        *target = endpoint::from_bytes(AF_INET, addr, read_port(addr + 4));
+        return 1 + 4 + 2;
+      case 3: {  // domain
+        if (left < 1) {
+          return 0;
+        }
+        int len = addr[0];
+        if (left < 1 + len + 2) {
+          return 0;
+        }
+        char domain[256];
+        memcpy(domain, addr + 1, len);
+        domain[len] = 0;
+        *target     = endpoint("tcp", domain, read_port(addr + 1 + len));
+        return 1 + 1 + len + 2;
+      }
       case 4:  // ipv6
-        *(ip + 16) = 0;
-        break;
+        if (left < 16 + 2) {
+          return 0;
+        }
+        *target = endpoint::from_bytes(AF_INET6, addr, read_port(addr + 16));
+        return 1 + 16 + 2;
       default:
-        return endpoint::null();
+        return 0;
     }
-    return endpoint("tcp", ip, port);
+  }
+
+  /** Writes ATYP, ADDR and PORT of ep, at most 19 bytes */
+  static int prepare_address(unsigned char *buffer, const endpoint &ep) {
+    bool v6        = ep.family() == AF_INET6;
+    int  addr_size = v6 ? 16 : 4;
+    buffer[0]      = v6 ? 4 : 1;
+    memcpy(buffer + 1, ep.bytes(), addr_size);
+    buffer[1 + addr_size] = (unsigned char)(ep.port() >> 8);
+    buffer[2 + addr_size] = (unsigned char)ep.port();
+    return 1 + addr_size + 2;
+  }
+
+  /** Writes the CONNECT request for target, at most 22 bytes */
+  static int prepare_request(unsigned char *buffer, const endpoint &target) {
+    buffer[0] = 5;
+    buffer[1] = CMD_CONNECT;
+    buffer[2] = 0;
+    return REQUEST_HEADER + prepare_address(buffer + REQUEST_HEADER, target);
   }
 
   static int prepare_response(unsigned char *buffer, bool success) {
@@ -71,7 +145,48 @@ public:
     return rsp_size;
   }
 
+  /** A successful reply naming bound, where an associated client sends its datagrams */
+  static int prepare_response(unsigned char *buffer, const endpoint &bound) {
+    buffer[0] = 5;
+    buffer[1] = 0;
+    buffer[2] = 0;
+    return REQUEST_HEADER + prepare_address(buffer + REQUEST_HEADER, bound);
+  }
+
 protected:
+  static int read_port(const unsigned char *p) { return p[0] << 8 | p[1]; }
+
+  static int command(const unsigned char *buffer, int size) {
+    return size < (int)sizeof(socks5_header) + 1 || buffer[0] != 5 ? 0 : buffer[1];
+  }
+
+  // Size of the whole request, 0 if it is truncated
+  static int request_size(const unsigned char *buffer, int size) {
+    int addr_size = address_size(buffer + REQUEST_HEADER, size - REQUEST_HEADER);
+    return addr_size > 0 ? REQUEST_HEADER + addr_size : 0;
+  }
+
+  static int address_size(const unsigned char *buffer, int size) {
+    if (size < 2) {
+      return 0;
+    }
+    int addr_size = 0;
+    switch (buffer[0]) {
+      case 1:
+        addr_size = 4;
+        break;
+      case 3:
+        addr_size = 1 + buffer[1];
+        break;
+      case 4:
+        addr_size = 16;
+        break;
+      default:
+        return 0;
+    }
+    return size >= 1 + addr_size + 2 ? 1 + addr_size + 2 : 0;
+  }
+
   struct socks5_header {
     uint8_t version;
     uint8_t cmd;
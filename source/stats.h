@@ -0,0 +1,113 @@
+// MIT License
+//
+// Copyright (c) 2020 Gui Yang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef KCPSS_STATS_H
+#define KCPSS_STATS_H
+
+#include "public.h"
+
+/** Process wide counters and gauges, logged every stats_interval seconds, shared by reactors. */
+class stats {
+public:
+  enum counter : int {
+    SESSIONS_ACTIVE = 0,
+    SESSIONS_EXPIRED,
+    STREAMS_EXPIRED,
+    DROPPED_SHORT,
+    DROPPED_TAG,
+    ACCEPTED,
+    ACCEPT_ERRORS,
+    ACCEPT_BATCH_MAX,
+    FAST_OPENS,
+    FAST_OPEN_BYTES,
+    DATAGRAMS_SENT,
+    DATAGRAMS_RECEIVED,
+    DATAGRAMS_DROPPED,
+    PRIORITY_QUEUED,
+    KEEPALIVES,
+    SEND_DEFERRED,
+    SEND_QUEUE_DEPTH,
+    SEND_QUEUE_MAX,
+    SEND_QUEUE_DROPPED,
+    TIMERS_ACTIVE,
+    TASKS_RUN,
+    TASK_WAKEUPS,
+    COUNTER_SIZE,
+  };
+
+  static void add(counter c, uint64_t n = 1) { values()[c].fetch_add(n, std::memory_order_relaxed); }
+  static void sub(counter c, uint64_t n = 1) { values()[c].fetch_sub(n, std::memory_order_relaxed); }
+  static void set(counter c, uint64_t value) { values()[c].store(value, std::memory_order_relaxed); }
+  static uint64_t get(counter c) { return values()[c].load(std::memory_order_relaxed); }
+
+  static void max(counter c, uint64_t value) {
+    uint64_t old = get(c);
+    while (old < value && !values()[c].compare_exchange_weak(old, value)) {
+    }
+  }
+
+  static const char *name(counter c) {
+    static const char *names[COUNTER_SIZE] = {
+      "sessions_active",
+      "sessions_expired",
+      "streams_expired",
+      "dropped_short",
+      "dropped_tag",
+      "accepted",
+      "accept_errors",
+      "accept_batch_max",
+      "fast_opens",
+      "fast_open_bytes",
+      "datagrams_sent",
+      "datagrams_received",
+      "datagrams_dropped",
+      "priority_queued",
+      "keepalives",
+      "send_deferred",
+      "send_queue_depth",
+      "send_queue_max",
+      "send_queue_dropped",
+      "timers_active",
+      "tasks_run",
+      "task_wakeups",
+    };
+    return names[c];
+  }
+
+  static std::string dump() {
+    std::string out;
+    for (int i = 0; i < COUNTER_SIZE; ++i) {
+      out += (i == 0 ? "" : " ");
+      out += name((counter)i);
+      out += "=" + std::to_string(get((counter)i));
+    }
+    return out;
+  }
+
+private:
+  static std::atomic<uint64_t> *values() {
+    static std::atomic<uint64_t> values_[COUNTER_SIZE]{};
+    return values_;
+  }
+};
+
+#endif  // KCPSS_STATS_H
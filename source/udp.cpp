@@ -20,39 +20,73 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <algorithm>
+#include <sys/uio.h>
+
 #include "udp.h"
 #include "socket.h"
 #include "timeUtility.h"
+#include "stats.h"
 
-udp::udp(Reactor *reactor, const char *addr, const char *remote_addr)
-  : reactor_(reactor), kcp_(nullptr), target_(nullptr), cb_(nullptr) {
-  fd_ = socket::create_udp(addr);
+const int udp::MIN_MTU;
+const int udp::MAX_MTU;
+const int udp::MAX_DELAY;
 
-  Reactor::Callback cb = std::bind(&udp::read_socket, this);
-  reactor_->RegisterIO(cb, fd_);
+udp::udp(Reactor *reactor, const char *addr, const char *remote_addr)
+  : reactor_(reactor)
+  , session_(nullptr)
+  , cb_(nullptr)
+  , max_mtu_(DEFAULT_MTU - siphash::TAG_SIZE)
+  , coalesce_(false)
+  , coalesce_delay_(0)
+  , stream_(false)
+  , keepalive_(0) {
+  // A random key until set_secret, nothing is accepted with a key nobody configured
+  std::random_device rd;
+  tag_    = siphash((uint64_t)rd() << 32U | rd(), (uint64_t)rd() << 32U | rd());
+  fd_     = socket::create_udp(endpoint(addr));
+  family_ = endpoint(addr).family();
 
-  if (remote_addr) {
-    target_ = new endpoint(remote_addr);
+  Reactor::DatagramCallback datagramCb = std::bind(&udp::on_datagram, this, _1, _2, _3, _4);
+  Reactor::SendErrorCallback failedCb = std::bind(&udp::on_send_error, this, _1, _2, _3, _4, _5);
+  if (!reactor_->RegisterDatagrams(datagramCb, failedCb, fd_)) {
+    Reactor::Callback cb = std::bind(&udp::read_socket, this);
+    reactor_->RegisterIO(cb, fd_);
   }
-  std::random_device         rd;
-  std::default_random_engine e(rd());
-  kcp_ = crtete_kcp(e());
+  Reactor::Callback writeCb = std::bind(&udp::send_queued, this);
+  reactor_->RegisterWritable(writeCb, fd_);
+  Reactor::Callback flushCb = std::bind(&udp::flush_pending, this);
+  flush_ = reactor_->RegisterPrepare(flushCb);
+  tick_.handler = Reactor::Handler::of<udp, &udp::on_tick>(this);
+  reactor_->StartTimer(tick_, 0, TICK_INTERVAL / 1000.0);
 
-  segment_      = reinterpret_cast<SessionHeader *>(new char[MTU]);
   recv_bufffer_ = new unsigned char[SIZE_4M];
+  probe_buffer_ = new unsigned char[MAX_MTU];
+  memset(probe_buffer_, 0, MAX_MTU);
+  datagram_buffer_ = new unsigned char[MAX_MTU];
+
+  if (remote_addr) {
+    target_ = endpoint(remote_addr);
+    std::default_random_engine e(rd());
+    session_ = crtete_kcp(e());
+    // Announce the session, the server answers mtu probes of known convs only
+    ikcp_probe(session_->kcp);
+  }
 }
 
 udp::~udp() {
-  if (target_) {
-    delete target_;
-    target_ = nullptr;
-  }
+  reactor_->StopTimer(tick_);
+  reactor_->RemoveDatagrams(fd_);
+  reactor_->RemovePrepare(flush_);
+  reactor_->RemoveWritable(fd_);
+  stats::sub(stats::SEND_QUEUE_DEPTH, send_queue_.size());
   if (cb_) {
     delete cb_;
     cb_ = nullptr;
   }
-  delete[](char *) segment_;
   delete[] recv_bufffer_;
+  delete[] probe_buffer_;
+  delete[] datagram_buffer_;
 }
 
 int udp_socket_output(const char *buf, int size, ikcpcb *kcp, void *fd) {
@@ -60,84 +94,742 @@ int udp_socket_output(const char *buf, int size, ikcpcb *kcp, void *fd) {
   return channel->write(kcp->conv, (unsigned char *)buf, size);
 }
 
-ikcpcb *udp::crtete_kcp(int conv) {
+session *udp::crtete_kcp(int conv) {
   LOG_INFO << "init kcp channel, kcpConv[" << conv << "]";
   ikcpcb *kcp = ikcp_create(conv, this);
   kcp->output = udp_socket_output;
+  kcp->stream = stream_ ? 1 : 0;
   ikcp_nodelay(kcp, 1, 1, 2, 1);
-  ikcp_wndsize(kcp, 4096, 4096);
-
-  Reactor::Callback kcpCb = [=](int elapse) -> int {
-    if (kcp) {
-      static uint64_t counter{0};
-      ikcp_update(kcp, now_ms());
-      if (counter++ % 60000 == 0) {
-        LOG_INFO << "[RTT]" << kcp->rx_srtt << " ms";
+  ikcp_wndsize(kcp, WINDOW, WINDOW);
+
+  auto *s        = new session(kcp);
+  s->last_active = now_ms();
+  reset_probe(s);
+  return s;
+}
+
+int udp::on_tick() {
+  if (send_blocked()) {
+    send_queued();
+  }
+  if (session_) {
+    update(session_, now_ms());
+  }
+  return 0;
+}
+
+void udp::update(session *s, uint32_t now) {
+  static thread_local uint64_t counter{0};
+  drain(s);
+  if (send_blocked()) {
+    // The socket buffer is full, kcp holds its segments instead of sending them to be lost,
+    // its clock stands still too so nothing times out meanwhile
+    return;
+  }
+  if (keepalive_ > 0) {
+    keepalive(s, now);
+  }
+  ikcp_update(s->kcp, now);
+  probe_mtu(s, now);
+  if (counter++ % 60000 == 0) {
+    LOG_INFO << "[RTT]" << s->kcp->rx_srtt << " ms, [MTU]" << s->kcp->mtu;
+  }
+}
+
+void udp::keepalive(session *s, uint32_t now) {
+  // Any traffic keeps the nat mapping, and whatever is sent gets acked, so only silence counts
+  if ((int32_t)(now - s->last_active) < (int32_t)keepalive_) {
+    return;
+  }
+  if ((int32_t)(s->last_active - s->keepalive_at) >= 0) {
+    s->keepalive_tries = 0;
+  }
+  // An unanswered probe is repeated, backing off from the rto up to the keepalive interval
+  uint32_t wait = std::min(keepalive_, std::max<uint32_t>(s->kcp->rx_rto, PROBE_TIMEOUT)
+                                         << std::min(s->keepalive_tries, 16));
+  if (s->keepalive_tries > 0 && (int32_t)(now - s->keepalive_at) < (int32_t)wait) {
+    return;
+  }
+  LOG_DBUG << "conv[" << s->kcp->conv << "] silent for " << now - s->last_active
+           << " ms, keepalive probe " << s->keepalive_tries;
+  ikcp_probe(s->kcp);
+  s->keepalive_at = now;
+  s->keepalive_tries++;
+  stats::add(stats::KEEPALIVES);
+}
+
+void udp::set_max_mtu(int mtu) {
+  // The tag rides in every datagram on top of the kcp mtu
+  max_mtu_ = std::max(MIN_MTU, std::min(mtu, MAX_MTU) - siphash::TAG_SIZE);
+  LOG_INFO << "path mtu discovery up to " << max_mtu_ + siphash::TAG_SIZE << " bytes";
+  if (session_) {
+    reset_probe(session_);
+  }
+}
+
+void udp::set_coalesce(bool coalesce, int delay) {
+  coalesce_       = coalesce;
+  coalesce_delay_ = std::max(0, std::min(delay, MAX_DELAY));
+  LOG_INFO << "frame coalescing " << (coalesce_ ? "enabled" : "disabled") << ", delay "
+           << coalesce_delay_ << " ms";
+}
+
+void udp::set_stream(bool stream) {
+  stream_ = stream;
+  if (stream_) {
+    coalesce_ = true;
+  }
+  if (session_) {
+    session_->kcp->stream = stream_ ? 1 : 0;
+  }
+  LOG_INFO << "kcp stream mode " << (stream_ ? "enabled" : "disabled");
+}
+
+void udp::set_secret(const std::string &secret) {
+  tag_ = siphash::from_string(secret);
+}
+
+void udp::set_keepalive(int nat_timeout) {
+  keepalive_ = nat_timeout > 0 ? (uint32_t)nat_timeout * 1000 / 2 : 0;
+  LOG_INFO << "keepalive after " << keepalive_ << " ms of silence";
+}
+
+// Segments the next kcp flush can not send would make every frame behind them wait, whatever
+// its class, so only as many as fit in the window are let in
+static bool backlogged(const ikcpcb *kcp) {
+  uint32_t window = std::min(kcp->snd_wnd, kcp->rmt_wnd);
+  if (kcp->nocwnd == 0) {
+    window = std::min(kcp->cwnd, window);
+  }
+  int room = (int)window - (int)(kcp->snd_nxt - kcp->snd_una);
+  return (int)kcp->nsnd_que >= std::min(std::max(room, 0), (int)udp::SEND_DEPTH);
+}
+
+void udp::set_priority_policy(const frame_scheduler::config &config) {
+  priority_ = config;
+  if (priority_.mode != frame_scheduler::NONE) {
+    bool strict = priority_.mode == frame_scheduler::STRICT;
+    LOG_INFO << "priority classes " << (strict ? "strict" : "weighted") << ", weights "
+             << priority_.weights[0] << "," << priority_.weights[1] << "," << priority_.weights[2]
+             << "," << priority_.weights[3];
+  }
+}
+
+void udp::set_priority(int conv, int sid, int cls) {
+  session_priority(session_, sid, cls);
+}
+
+void udp::session_priority(session *s, int sid, int cls) {
+  if (cls < 0) {
+    s->classes.erase(sid);
+  } else {
+    s->classes[sid] = (uint8_t)std::min(cls, frame_scheduler::CLASSES - 1);
+  }
+}
+
+bool udp::scheduling(session *s) const {
+  if (priority_.mode == frame_scheduler::NONE) {
+    return false;
+  }
+  return !s->scheduler.empty() || backlogged(s->kcp);
+}
+
+void udp::drain(session *s) {
+  if (s->scheduler.empty()) {
+    return;
+  }
+  auto admit = [s]() { return !backlogged(s->kcp); };
+  auto send = [this, s](frame_type type, int sid, unsigned char *buffer, int size) {
+    write_frame(s, sid, type, buffer, size);
+  };
+  s->scheduler.drain(priority_, (int)s->kcp->mss, admit, send);
+}
+
+void udp::reset_probe(session *s) {
+  if ((int)s->kcp->mtu > max_mtu_) {
+    ikcp_setmtu(s->kcp, max_mtu_);
+  }
+  s->mtu          = pmtu{};
+  s->mtu.lo       = (int)s->kcp->mtu;
+  s->mtu.hi       = max_mtu_;
+  s->mtu.deadline = now_ms();
+}
+
+void udp::probe_mtu(session *s, uint32_t now) {
+  pmtu &m = s->mtu;
+  if ((int32_t)(now - m.deadline) < 0) {
+    return;
+  }
+  if (m.size > 0 && m.tries >= PROBE_TRIES) {
+    if (m.size <= m.lo) {
+      // The size in use is lost as well, the path shrank
+      fall_back(s, "to get through");
+      return;
+    }
+    LOG_DBUG << "conv[" << s->kcp->conv << "] mtu probe of " << m.size << " bytes lost";
+    m.hi   = m.size - 1;
+    m.size = 0;
+  }
+  if (m.size == 0) {
+    if (m.verify && m.lo > base_mtu()) {
+      // Confirm the size in use before searching above it
+      m.size = m.lo;
+    } else if (m.hi - m.lo < PROBE_STEP) {
+      // Converged, search again later since the path may have changed
+      m.hi       = max_mtu_;
+      m.verify   = true;
+      m.deadline = now + PROBE_INTERVAL;
+      return;
+    } else {
+      m.size = m.lo + (m.hi - m.lo + 1) / 2;
+    }
+    m.verify = false;
+    m.tries  = 0;
+  }
+  m.tries++;
+  m.deadline = now + std::max<uint32_t>(s->kcp->rx_rto, PROBE_TIMEOUT);
+  write_control(s->kcp->conv, CMD_PROBE, m.size, m.size);
+}
+
+int udp::base_mtu() const {
+  return std::min(DEFAULT_MTU - siphash::TAG_SIZE, max_mtu_);
+}
+
+// Back to the mtu every session starts with, the search restarts below the size that failed.
+// kcp cuts its queued segments to the new mss, segments in flight keep their size and sn, the
+// kernel fragments them once it learned the path mtu
+void udp::fall_back(session *s, const char *reason) {
+  pmtu &m  = s->mtu;
+  int   at = (int)s->kcp->mtu;
+  LOG_WARN << "conv[" << s->kcp->conv << "] path mtu of " << at << " bytes failed " << reason
+           << ", back to " << base_mtu();
+  ikcp_setmtu(s->kcp, base_mtu());
+  m          = pmtu{};
+  m.lo       = base_mtu();
+  m.hi       = std::max(m.lo, at - 1);
+  m.deadline = now_ms();
+}
+
+// Sends of the session refused by the socket, not the probes, which fail by design, error is the
+// errno of the send or 0
+void udp::sent(session *s, int error) {
+  if (direct_) {
+    return;
+  }
+  if (error != EMSGSIZE) {
+    s->mtu.refused = 0;
+  } else if (++s->mtu.refused >= PROBE_TRIES && (int)s->kcp->mtu > base_mtu()) {
+    fall_back(s, "with EMSGSIZE");
+  }
+}
+
+int udp::write_control(int conv, uint8_t cmd, uint32_t value, int size) {
+  auto *header = reinterpret_cast<ControlHeader *>(probe_buffer_);
+  header->conv = conv;
+  header->cmd  = cmd;
+  header->size = value;
+  if (cmd != CMD_PROBE) {
+    return write(conv, probe_buffer_, size);
+  }
+  // Probes must not be fragmented, neither by us nor by routers on the path, the socket
+  // option only holds for a send made right away
+  direct_ = true;
+  socket::probe_path(fd_, family_, true);
+  int ret = write(conv, probe_buffer_, size);
+  socket::probe_path(fd_, family_, false);
+  direct_ = false;
+  return ret;
+}
+
+bool udp::is_control(const unsigned char *buffer, int size) {
+  if (size < ControlHeaderSize) {
+    return false;
+  }
+  auto *header = reinterpret_cast<const ControlHeader *>(buffer);
+  return header->cmd == CMD_PROBE || header->cmd == CMD_PROBE_ACK || header->cmd == CMD_DATAGRAM;
+}
+
+void udp::on_control(session *s, unsigned char *buffer, int size) {
+  auto *header = reinterpret_cast<ControlHeader *>(buffer);
+  pmtu &m      = s->mtu;
+  switch (header->cmd) {
+    case CMD_PROBE:
+      if ((int)header->size == size) {
+        write_control(header->conv, CMD_PROBE_ACK, header->size, ControlHeaderSize);
+      }
+      break;
+    case CMD_PROBE_ACK:
+      if (m.size > 0 && (int)header->size == m.size) {
+        if (m.size > m.lo) {
+          LOG_INFO << "conv[" << s->kcp->conv << "] path mtu raised from " << m.lo << " to "
+                   << m.size << " bytes";
+        } else {
+          LOG_DBUG << "conv[" << s->kcp->conv << "] path mtu of " << m.size << " bytes confirmed";
+        }
+        ikcp_setmtu(s->kcp, m.size);
+        m.lo       = m.size;
+        m.size     = 0;
+        m.deadline = now_ms();
+      }
+      break;
+    case CMD_DATAGRAM: {
+      frame_header   datagram{};
+      unsigned char *payload = buffer + ControlHeaderSize;
+      int            left    = size - ControlHeaderSize;
+      int            head    = frame::decode_header(payload, left, &datagram);
+      if (head <= 0 || datagram.type != frame_type::DATAGRAM ||
+          head + (int)datagram.length > left) {
+        stats::add(stats::DATAGRAMS_DROPPED);
+        break;
       }
+      stats::add(stats::DATAGRAMS_RECEIVED);
+      on_frame(s, datagram, payload + head, (int)datagram.length);
+      break;
     }
+    default:
+      break;
+  }
+}
+
+int udp::send_datagram(int conv, int sid, unsigned char *buffer, int size) {
+  int frame_size = frame::header_size(sid, size) + size;
+  if (ControlHeaderSize + frame_size > MAX_MTU - siphash::TAG_SIZE) {
+    stats::add(stats::DATAGRAMS_DROPPED);
+    return -1;
+  }
+  auto *header = reinterpret_cast<ControlHeader *>(datagram_buffer_);
+  header->conv = session_ ? session_->kcp->conv : (uint32_t)conv;
+  header->cmd  = CMD_DATAGRAM;
+  header->size = frame_size;
+  memset(header->reserved, 0, sizeof(header->reserved));
+  unsigned char *dst = datagram_buffer_ + ControlHeaderSize;
+  dst += frame::encode_header(dst, frame_type::DATAGRAM, 0, sid, size);
+  memcpy(dst, buffer, size);
+  stats::add(stats::DATAGRAMS_SENT);
+  return write(conv, datagram_buffer_, ControlHeaderSize + frame_size);
+}
+
+int udp::send(int conv, int sid, frame_type type, unsigned char *buffer, int size) {
+  return session_send(session_, sid, type, buffer, size);
+}
+
+int udp::session_send(session *s, int sid, frame_type type, unsigned char *buffer, int size) {
+  if (priority_.mode == frame_scheduler::NONE) {
+    return write_frame(s, sid, type, buffer, size);
+  }
+  // Data goes in pieces of a segment, so a long read can not take the window in one go
+  int  chunk  = type == frame_type::DATA ? (int)s->kcp->mss - frame::MAX_HEADER_SIZE : size;
+  auto it     = s->classes.find(sid);
+  int  cls    = it == s->classes.end() ? frame_scheduler::DEFAULT_CLASS : it->second;
+  bool queued = false;
+  do {
+    int length = std::min(size, chunk);
+    if (scheduling(s)) {
+      // The window is full, the frame waits in the queue of its class
+      s->scheduler.push(cls, type, sid, buffer, length);
+      stats::add(stats::PRIORITY_QUEUED);
+      queued = true;
+    } else if (write_frame(s, sid, type, buffer, length) < 0) {
+      return -1;
+    }
+    buffer += length;
+    size -= length;
+  } while (size > 0);
+  if (queued) {
+    drain(s);
+  }
+  return 0;
+}
+
+int udp::write_frame(session *s, int sid, frame_type type, unsigned char *buffer, int size) {
+  ikcpcb *kcp   = s->kcp;
+  uint8_t flags = 0;
+  if (type == frame_type::OPEN || type == frame_type::OPEN_PIPELINED) {
+    auto it = s->classes.find(sid);
+    flags   = it == s->classes.end() ? frame_scheduler::DEFAULT_CLASS : it->second;
+  }
+  // Until the last byte is committed, a header only frame included after a flush made room
+  for (;;) {
+    int   room;
+    auto *dst = reinterpret_cast<unsigned char *>(ikcp_reserve(kcp, &room));
+    if (dst == nullptr) {
+      return -1;
+    }
+    int length = std::min(size, room - frame::header_size(sid, size));
+    if (length < size && (type != frame_type::DATA || length < frame::MIN_SPLIT)) {
+      if (ikcp_pending(kcp) > 0) {
+        flush(s);
+        continue;
+      }
+      if (type != frame_type::DATA) {
+        LOG_WARN << "frame of " << size << " bytes exceeds mss " << kcp->mss << ", sid[" << sid
+                 << "]";
+        return -1;
+      }
+    }
+    if (ikcp_pending(kcp) == 0) {
+      s->pending_since = now_ms();
+    }
+    int head = frame::encode_header(dst, type, flags, sid, length);
+    if (length > 0) {
+      memcpy(dst + head, buffer, length);
+    }
+    ikcp_commit(kcp, head + length);
+    buffer += length;
+    size -= length;
+    if (size == 0) {
+      break;
+    }
+    flush(s);
+  }
+  return queue(s);
+}
+
+unsigned char *udp::reserve(int conv, int sid, int *size) {
+  return session_reserve(session_, sid, size);
+}
+
+int udp::commit(int conv, int sid, int size) {
+  return session_commit(session_, sid, size);
+}
+
+unsigned char *udp::session_reserve(session *s, int sid, int *size) {
+  if (scheduling(s)) {
+    // Data has to queue behind its class, it goes through send
+    *size = 0;
+    return nullptr;
+  }
+  ikcpcb *kcp = s->kcp;
+  int     room;
+  auto *  dst = reinterpret_cast<unsigned char *>(ikcp_reserve(kcp, &room));
+  // The header goes first, sized for the largest payload that fits
+  int head = frame::header_size(sid, room);
+  if (room - head < frame::MIN_SPLIT && ikcp_pending(kcp) > 0) {
+    flush(s);
+    dst  = reinterpret_cast<unsigned char *>(ikcp_reserve(kcp, &room));
+    head = frame::header_size(sid, room);
+  }
+  if (dst == nullptr || room - head < frame::MIN_SPLIT) {
+    *size = 0;
+    return nullptr;
+  }
+  s->reserved_head = head;
+  *size            = room - head;
+  return dst + head;
+}
+
+int udp::session_commit(session *s, int sid, int size) {
+  if (size <= 0) {
     return 0;
-  };
-  reactor_->RegisterTimer(kcpCb, 19890, 1);
-  return kcp;
+  }
+  ikcpcb *kcp = s->kcp;
+  int     room;
+  auto *  dst = reinterpret_cast<unsigned char *>(ikcp_reserve(kcp, &room));
+  if (ikcp_pending(kcp) == 0) {
+    s->pending_since = now_ms();
+  }
+  // The length was not known when the room was reserved, pad it to the reserved width
+  int width = s->reserved_head - 1 - frame::varint_size(sid);
+  frame::encode_header(dst, frame_type::DATA, 0, sid, size, width);
+  ikcp_commit(kcp, s->reserved_head + size);
+  return queue(s);
 }
 
-int udp::send(int conv, int sid, unsigned char *buffer, int size) {
-  segment_->sid  = sid;
-  segment_->size = MAX_PAYLOAD;
-  while (size > MAX_PAYLOAD) {
-    memcpy(segment_->data, buffer, MAX_PAYLOAD);
-    ikcp_send(kcp_, (const char *)segment_, MTU);
-    size -= MAX_PAYLOAD;
-    buffer += MAX_PAYLOAD;
+int udp::queue(session *s) {
+  int pending = ikcp_pending(s->kcp);
+  if (pending == 0) {
+    return 0;
+  }
+  if (!coalesce_ || pending > (int)s->kcp->mss - frame::MIN_SPLIT) {
+    return flush(s);
+  }
+  // Leave it to the end of loop flush, more frames may join
+  if (!s->dirty) {
+    s->dirty = true;
+    dirty_.push_back(s);
   }
-  segment_->size = size;
-  memcpy(segment_->data, buffer, size);
-  return ikcp_send(kcp_, (const char *)segment_, size + SessionHeaderSize);
+  return 0;
+}
+
+int udp::flush(session *s) {
+  ikcp_push(s->kcp);
+  return 0;
+}
+
+int udp::flush_pending() {
+  uint32_t now  = now_ms();
+  size_t   kept = 0;
+  for (auto *s : dirty_) {
+    int  pending = ikcp_pending(s->kcp);
+    bool full    = pending > (int)s->kcp->mss - frame::MIN_SPLIT;
+    if (!full && pending > 0 && (int32_t)(now - s->pending_since) < coalesce_delay_) {
+      // Still within the delay budget, wait for more small writes
+      dirty_[kept++] = s;
+      continue;
+    }
+    flush(s);
+    s->dirty = false;
+  }
+  dirty_.resize(kept);
+  return 0;
 }
 
 int udp::write(int conv, unsigned char *buffer, int size) {
-  endpoint ep(*target_);
-  LOG_DBUG << ep << "|" << fd() << "|" << kcp_->conv << " write " << size << " bytes";
-  int len = sizeof(sockaddr);
-  return ::sendto(fd_, buffer, size, 0, (struct sockaddr *)target_->sockaddr(), len);
+  LOG_DBUG << fd() << "|" << conv << " write " << size << " bytes";
+  int ret = write_to(target_, buffer, size);
+  if (session_ && !ringed_) {
+    sent(session_, ret < 0 ? errno : 0);
+  }
+  return ret;
 }
 
-int udp::read_socket() {
-  while (true) {
-    sockaddr_in target{};
-    socklen_t   len = sizeof(target);
-    ssize_t     ret = ::recvfrom(fd_, recv_bufffer_, SIZE_4M, 0, (sockaddr *)&target, &len);
-    if (target_ == nullptr) {
-      target_ = new endpoint(target);
+int udp::write_to(const endpoint &target, unsigned char *buffer, int size) {
+  unsigned char tag[siphash::TAG_SIZE];
+  tag_.sign(buffer, size, tag);
+  ringed_ = false;
+  if (send_blocked()) {
+    return defer(target, buffer, size, tag);
+  }
+
+  struct iovec iov[2];
+  iov[0].iov_base = buffer;
+  iov[0].iov_len  = size;
+  iov[1].iov_base = tag;
+  iov[1].iov_len  = sizeof(tag);
+
+  struct msghdr msg {};
+  msg.msg_name    = const_cast<struct sockaddr *>(target.sockaddr());
+  msg.msg_namelen = target.size();
+  msg.msg_iov     = iov;
+  msg.msg_iovlen  = 2;
+  ringed_         = !direct_ && reactor_->SendDatagram(fd_, msg);
+  if (ringed_) {
+    return size;
+  }
+  auto ret = ::sendmsg(fd_, &msg, MSG_DONTWAIT);
+  if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)) {
+    return defer(target, buffer, size, tag);
+  }
+  return ret < 0 ? (int)ret : (int)ret - siphash::TAG_SIZE;
+}
+
+int udp::defer(const endpoint &target, unsigned char *buffer, int size, const unsigned char *tag) {
+  if ((int)send_queue_.size() >= SEND_QUEUE) {
+    stats::add(stats::SEND_QUEUE_DROPPED);
+    return -1;
+  }
+  send_queue_.push_back(queued_datagram{target, {}});
+  auto &bytes = send_queue_.back().bytes;
+  bytes.reserve(size + siphash::TAG_SIZE);
+  bytes.insert(bytes.end(), buffer, buffer + size);
+  bytes.insert(bytes.end(), tag, tag + siphash::TAG_SIZE);
+  stats::add(stats::SEND_DEFERRED);
+  stats::add(stats::SEND_QUEUE_DEPTH);
+  stats::max(stats::SEND_QUEUE_MAX, send_queue_.size());
+  if (send_queue_.size() == 1) {
+    watch(true);
+  }
+  return size;
+}
+
+// A reactor send the socket refused, signed already, handled like a refused sendmsg
+void udp::on_send_error(int error, unsigned char *buffer, int size, const struct sockaddr *to,
+                        socklen_t len) {
+  int payload = size - siphash::TAG_SIZE;
+  if (error == EAGAIN || error == EWOULDBLOCK || error == ENOBUFS) {
+    defer(endpoint(to, len), buffer, payload, buffer + payload);
+    return;
+  }
+  if (error != EMSGSIZE) {
+    LOG_WARN << "send of " << payload << " bytes to " << endpoint(to, len) << " failed, errno "
+             << error;
+  }
+  // Kcp segments and control datagrams both start with the conv
+  session *s = owner((uint32_t)ikcp_getconv(buffer));
+  if (s != nullptr) {
+    sent(s, error);
+  }
+}
+
+int udp::send_queued() {
+  size_t sent = 0;
+  for (; sent < send_queue_.size(); ++sent) {
+    auto &d   = send_queue_[sent];
+    auto  ret = ::sendto(fd_, d.bytes.data(), d.bytes.size(), MSG_DONTWAIT, d.target.sockaddr(),
+                         d.target.size());
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)) {
+      // Readiness does not tell when the device queue has room again, ENOBUFS waits for the tick
+      watch(errno != ENOBUFS);
+      break;
     }
     if (ret < 0) {
-      LOG_CRIT << "read udp socket error, fd[" << fd_ << "], ret = " << (int)ret;
-    } else if (ret == 0) {
-      break;
-    } else if (ret < SIZE_4M) {
-      on_read(recv_bufffer_, ret, &target);
+      LOG_WARN << "drop queued datagram to " << d.target << ", errno " << errno;
+    }
+  }
+  send_queue_.erase(send_queue_.begin(), send_queue_.begin() + sent);
+  stats::sub(stats::SEND_QUEUE_DEPTH, sent);
+  if (send_queue_.empty()) {
+    watch(false);
+  }
+  return 0;
+}
+
+void udp::watch(bool writable) {
+  if (watching_ != writable) {
+    watching_ = writable;
+    reactor_->WatchWritable(fd_, writable);
+  }
+}
+
+bool udp::verify(unsigned char *buffer, int *size) {
+  if (*size < ControlHeaderSize + siphash::TAG_SIZE) {
+    stats::add(stats::DROPPED_SHORT);
+    return false;
+  }
+  if (!tag_.verify(buffer, *size)) {
+    stats::add(stats::DROPPED_TAG);
+    return false;
+  }
+  *size -= siphash::TAG_SIZE;
+  return true;
+}
+
+int udp::read_socket() {
+  // Level triggered like every watcher, datagrams left over wait for the next loop iteration
+  for (int i = 0; i < READ_BATCH; ++i) {
+    endpoint  from;
+    socklen_t len = endpoint::capacity();
+    ssize_t   ret = ::recvfrom(fd_, recv_bufffer_, SIZE_4M, MSG_DONTWAIT, from.sockaddr(), &len);
+    if (ret < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        LOG_CRIT << "read udp socket error, fd[" << fd_ << "], errno = " << errno;
+      }
       break;
-    } else if (ret == SIZE_4M) {
-      on_read(recv_bufffer_, ret, &target);
+    }
+    int size = (int)ret;
+    if (verify(recv_bufffer_, &size)) {
+      on_read(recv_bufffer_, size, from);
     }
   }
   return 0;
 }
 
-void udp::on_read(unsigned char *buffer, int size, sockaddr_in *target) {
-  if (kcp_) {
-    endpoint ep(*target);
-    LOG_DBUG << ep << "|" << fd() << "|" << kcp_->conv << " read " << size << " bytes";
-    ikcp_input(kcp_, reinterpret_cast<const char *>(buffer), size);
-    int payload_size;
-    do {
-      payload_size = ikcp_recv(kcp_, (char *)segment_, MTU);
-      if (payload_size > 0) {
-        if (cb_) {
-          (*cb_)(kcp_->conv, segment_->sid, segment_->data, segment_->size);
-        }
+void udp::on_datagram(unsigned char *buffer, int size, const struct sockaddr *from,
+                      socklen_t len) {
+  if (verify(buffer, &size)) {
+    on_read(buffer, size, endpoint(from, len));
+  }
+}
+
+void udp::on_read(unsigned char *buffer, int size, const endpoint &from) {
+  if (session_) {
+    LOG_DBUG << fd() << "|" << session_->kcp->conv << " read " << size << " bytes";
+    on_session_read(session_, buffer, size);
+  }
+}
+
+void udp::on_session_read(session *s, unsigned char *buffer, int size) {
+  if (is_control(buffer, size)) {
+    s->last_active = now_ms();
+    on_control(s, buffer, size);
+    return;
+  }
+  ikcpcb *kcp = s->kcp;
+  auto    ret = ikcp_input(kcp, reinterpret_cast<const char *>(buffer), size);
+  if (ret != 0) {
+    LOG_CRIT << "ikcp_input failed ";
+    return;
+  }
+  s->last_active = now_ms();
+  // Frames are decoded in place, their segments are released after the flush callback
+  char *data[RECV_BATCH];
+  int   length[RECV_BATCH];
+  int   count;
+  while ((count = ikcp_peek(kcp, data, length, RECV_BATCH)) > 0) {
+    for (int i = 0; i < count; ++i) {
+      on_message(s, reinterpret_cast<unsigned char *>(data[i]), length[i]);
+    }
+    if (flush_cb_) {
+      flush_cb_((int)kcp->conv, (int)kcp->nrcv_que > count);
+    }
+    ikcp_consume(kcp, count);
+  }
+}
+
+void udp::on_message(session *s, unsigned char *buffer, int size) {
+  auto &reader = s->reader;
+  while (size > 0) {
+    if (reader.remaining > 0) {
+      // The rest of a data frame split across kcp segments
+      int length = std::min((int)reader.remaining, size);
+      reader.remaining -= length;
+      on_frame(s, reader.header, buffer, length);
+      buffer += length;
+      size -= length;
+      continue;
+    }
+    auto &carry = reader.carry;
+    int   head  = 0;
+    if (!carry.empty()) {
+      // Complete the split header byte by byte, a header is at most 11 bytes
+      while ((head = frame::decode_header(carry.data(), (int)carry.size(), &reader.header)) == 0 &&
+             size > 0) {
+        carry.push_back(*buffer++);
+        --size;
       }
-    } while (payload_size >= 0);
+    } else {
+      head = frame::decode_header(buffer, size, &reader.header);
+    }
+    if (head < 0) {
+      LOG_WARN << "conv[" << s->kcp->conv << "] drop malformed frame of " << size << " bytes";
+      reader = frame_reader{};
+      return;
+    }
+    if (head == 0) {
+      carry.insert(carry.end(), buffer, buffer + size);
+      return;
+    }
+    auto &header = reader.header;
+    if (header.type == frame_type::DATA) {
+      // Data may be handed out in pieces, skip the header and stream the payload
+      if (carry.empty()) {
+        buffer += head;
+        size -= head;
+      }
+      carry.clear();
+      reader.remaining = header.length;
+      if (header.length == 0) {
+        on_frame(s, header, buffer, 0);
+      }
+      continue;
+    }
+    // Other frames are delivered whole, collect them in the carry if split
+    int frame_size = head + (int)header.length;
+    if (carry.empty() && frame_size <= size) {
+      on_frame(s, header, buffer + head, (int)header.length);
+      buffer += frame_size;
+      size -= frame_size;
+      continue;
+    }
+    int length = std::min(frame_size - (int)carry.size(), size);
+    carry.insert(carry.end(), buffer, buffer + length);
+    buffer += length;
+    size -= length;
+    if ((int)carry.size() == frame_size) {
+      on_frame(s, header, carry.data() + head, (int)header.length);
+      carry.clear();
+    }
+  }
+}
+
+void udp::on_frame(session *s, const frame_header &header, unsigned char *buffer, int size) {
+  if (priority_.mode != frame_scheduler::NONE &&
+      (header.type == frame_type::OPEN || header.type == frame_type::OPEN_PIPELINED)) {
+    // The peer classified the stream, its replies share the class
+    session_priority(s, (int)header.sid, header.flags);
+  }
+  if (cb_) {
+    (*cb_)(s->kcp->conv, (int)header.sid, header.type, buffer, size);
   }
 }
 
@@ -147,81 +839,193 @@ void udp::set_session_callback(udp::SessionCallbck &cb) {
   }
 }
 
-void udp_server::on_read(unsigned char *buffer, int size, sockaddr_in *target) {
-  endpoint ep(*target);
-  ikcpcb * kcp;
-  int      conv = ikcp_getconv(buffer);
-  LOG_DBUG << ep << "|" << fd() << "|" << conv << " read " << size << " bytes";
-  if (!connected_client(conv)) {
-    if (client_conv_.find(ep) != client_conv_.end()) {
-      auto *old_kcp  = client_conv_[ep];
-      auto  old_conv = old_kcp->conv;
-      LOG_INFO << "Release old kcp conv[" << old_conv << "], target[" << ep.host() << ":"
-               << ep.port() << "]";
-      ikcp_release(old_kcp);
-      conv_ep_.erase(old_conv);
-      conv_kcp_.erase(old_conv);
-    }
-    kcp = crtete_kcp(conv);
-    LOG_INFO << "new kcp conv[" << conv << "] from " << ep.host() << ":" << ep.port();
-    client_conv_[ep] = kcp;
-    conv_kcp_[conv]  = kcp;
-    conv_ep_[conv]   = ep;
-  } else {
-    kcp         = conv_kcp_[conv];
-    auto old_ep = conv_ep_[conv];
-    if (!(old_ep == ep)) {
-      LOG_INFO << "conv[" << conv << "] end point changed from [" << old_ep.host() << ":"
-               << old_ep.port() << "] to [" << ep.host() << ":" << ep.port() << "]";
-      conv_ep_[conv]   = ep;
-      client_conv_[ep] = kcp;
-    }
-  }
-  if (kcp) {
-    auto ret = ikcp_input(kcp, reinterpret_cast<const char *>(buffer), size);
-    if (ret != 0) {
-      LOG_CRIT << "ikcp_input failed ";
+void udp::set_flush_callback(udp::FlushCallbck &cb) {
+  flush_cb_ = cb;
+}
+
+void udp_server::on_read(unsigned char *buffer, int size, const endpoint &from) {
+  auto  conv   = (uint32_t)ikcp_getconv(buffer);
+  auto *record = sessions_.find(conv);
+  LOG_DBUG << fd() << "|" << conv << " read " << size << " bytes";
+  if (record == nullptr) {
+    if (is_control(buffer, size)) {
+      LOG_DBUG << "drop control datagram of unknown conv[" << conv << "]";
       return;
     }
-    int payload_size;
-    do {
-      payload_size = ikcp_recv(kcp, (char *)segment_, MTU);
-      if (payload_size > 0) {
-        if (cb_) {
-          (*cb_)(kcp->conv, segment_->sid, segment_->data, segment_->size);
-        }
+    auto *old = sessions_.find_peer(from);
+    if (old != nullptr) {
+      LOG_INFO << "Release old kcp conv[" << old->conv << "], target[" << from << "]";
+      release(old->conv);
+    }
+    session *s = crtete_kcp(conv);
+    if (session_rate_ > 0) {
+      s->bucket.reset(session_rate_, std::max(session_rate_ * RATE_BURST / 1000, 64.0 * 1024),
+                      s->last_active);
+    }
+    LOG_INFO << "new kcp conv[" << conv << "] from " << from;
+    record = sessions_.insert(conv, s, from);
+    stats::set(stats::SESSIONS_ACTIVE, sessions_.size());
+    if (idle_timeout_ > 0) {
+      expiry_.schedule(conv, s->last_active + idle_timeout_);
+    }
+  } else if (!record->from(from)) {
+    LOG_INFO << "conv[" << conv << "] end point changed from [" << record->peer << "] to [" << from
+             << "]";
+    record->peer = from;
+  }
+  record->rx_packets++;
+  record->rx_bytes += size;
+  on_session_read(record->s, buffer, size);
+}
+
+int udp_server::on_tick() {
+  if (send_blocked()) {
+    send_queued();
+  }
+  uint32_t now     = now_ms();
+  bool     shaping = session_rate_ > 0 || uplink_.limited();
+  if (uplink_.limited()) {
+    uplink_.refill(now);
+  }
+  sessions_.for_each(
+    [this, now, shaping](session_record &record) {
+      if (shaping) {
+        shape(record.s, now);
       }
-    } while (payload_size >= 0);
-  } else {
-    LOG_CRIT << "no kcp found for " << ep.host() << ":" << ep.port() << " conv[" << conv << "] fd["
-             << fd() << "]";
+      update(record.s, now);
+    },
+    cursor_++);
+  expiry_.advance(now, [this, now](uint32_t conv) {
+    auto *record = sessions_.find(conv);
+    if (record == nullptr || idle_timeout_ == 0) {
+      return;
+    }
+    uint32_t deadline = record->s->last_active + idle_timeout_;
+    if ((int32_t)(now - deadline) < 0) {
+      expiry_.schedule(conv, deadline);
+      return;
+    }
+    LOG_INFO << "conv[" << conv << "] idle for " << (now - record->s->last_active)
+             << " ms, release it";
+    stats::add(stats::SESSIONS_EXPIRED);
+    release(conv);
+  });
+  return 0;
+}
+
+void udp_server::set_idle_timeout(int seconds) {
+  idle_timeout_ = seconds > 0 ? (uint32_t)seconds * 1000 : 0;
+  LOG_INFO << "session idle timeout " << seconds << " s";
+}
+
+void udp_server::set_rate_limit(int session_rate, int uplink_rate) {
+  session_rate_ = std::max(session_rate, 0) * 1024.0;
+  if (uplink_rate > 0) {
+    double rate = uplink_rate * 1024.0;
+    uplink_.reset(rate, std::max(rate * RATE_BURST / 1000, 64.0 * 1024), now_ms());
+    quantum_ = std::max(rate * TICK_INTERVAL / 1000, (double)DEFAULT_MTU);
+  }
+  LOG_INFO << "rate limit " << session_rate << " KiB/s per session, " << uplink_rate
+           << " KiB/s in total";
+}
+
+// Opens the kcp window only as far as the session may send, data beyond waits unsent instead of
+// being pushed out, dropped on the way and retransmitted
+void udp_server::shape(session *s, uint32_t now) {
+  ikcpcb *kcp  = s->kcp;
+  double  room = (double)WINDOW * kcp->mss;
+  if (s->bucket.limited()) {
+    s->bucket.refill(now);
+    room = std::min(room, s->bucket.tokens);
   }
+  if (uplink_.limited()) {
+    // Deficit round robin, each session with data to send is credited a quantum per tick
+    bool backlog = kcp->nsnd_que > 0 || !s->scheduler.empty() || ikcp_pending(kcp) > 0;
+    s->deficit   = backlog ? std::min(s->deficit + quantum_, uplink_.burst) : 0;
+    room         = std::min(room, std::min(s->deficit, uplink_.tokens));
+  }
+  uint32_t inflight = kcp->snd_nxt - kcp->snd_una;
+  kcp->snd_wnd = std::min<uint32_t>(WINDOW, inflight + (uint32_t)(std::max(room, 0.0) / kcp->mss));
+}
+
+session *udp_server::owner(uint32_t conv) {
+  auto *record = sessions_.find(conv);
+  return record == nullptr ? nullptr : record->s;
+}
+
+void udp_server::set_release_callback(ReleaseCallback &cb) {
+  release_cb_ = cb;
 }
-bool udp_server::connected_client(int conv) {
-  auto it = conv_kcp_.find(conv);
-  return !(it == conv_kcp_.end());
+
+void udp_server::release(uint32_t conv) {
+  auto *record = sessions_.find(conv);
+  if (record == nullptr) {
+    return;
+  }
+  session *s = record->s;
+  LOG_INFO << "release conv[" << conv << "], rx " << record->rx_packets << " packets "
+           << record->rx_bytes << " bytes, tx " << record->tx_packets << " packets "
+           << record->tx_bytes << " bytes";
+  sessions_.erase(conv);
+  if (s->dirty) {
+    dirty_.erase(std::remove(dirty_.begin(), dirty_.end(), s), dirty_.end());
+  }
+  ikcp_release(s->kcp);
+  delete s;
+  stats::set(stats::SESSIONS_ACTIVE, sessions_.size());
+  if (release_cb_) {
+    release_cb_((int)conv);
+  }
 }
+
 int udp_server::write(int conv, unsigned char *buffer, int size) {
-  endpoint ep(conv_ep_[conv]);
-  LOG_DBUG << ep << "|" << fd() << "|" << conv << " write " << size << " bytes";
-  int len = sizeof(sockaddr);
-  return ::sendto(fd_, buffer, size, 0, (struct sockaddr *)ep.sockaddr(), len);
-}
-int udp_server::send(int conv, int sid, unsigned char *buffer, int size) {
-  segment_->sid  = sid;
-  segment_->size = MAX_PAYLOAD;
-  if (conv_kcp_.find(conv) == conv_kcp_.end()) {
+  auto *record = sessions_.find((uint32_t)conv);
+  if (record == nullptr) {
+    return -1;
+  }
+  LOG_DBUG << fd() << "|" << conv << " write " << size << " bytes";
+  record->tx_packets++;
+  record->tx_bytes += size;
+  if (record->s->bucket.limited()) {
+    record->s->bucket.consume(size);
+  }
+  if (uplink_.limited()) {
+    record->s->deficit -= size;
+    uplink_.consume(size);
+  }
+  int ret = write_to(record->peer, buffer, size);
+  if (!ringed_) {
+    sent(record->s, ret < 0 ? errno : 0);
+  }
+  return ret;
+}
+
+int udp_server::send(int conv, int sid, frame_type type, unsigned char *buffer, int size) {
+  auto *record = sessions_.find((uint32_t)conv);
+  if (record == nullptr) {
     LOG_WARN << "no kcp found for conv[" << conv << "] sid[" << sid << "]";
     return -1;
   }
-  ikcpcb *kcp = conv_kcp_[conv];
-  while (size > MAX_PAYLOAD) {
-    memcpy(segment_->data, buffer, MAX_PAYLOAD);
-    ikcp_send(kcp, (const char *)segment_, MTU);
-    size -= MAX_PAYLOAD;
-    buffer += MAX_PAYLOAD;
+  return session_send(record->s, sid, type, buffer, size);
+}
+
+unsigned char *udp_server::reserve(int conv, int sid, int *size) {
+  auto *record = sessions_.find((uint32_t)conv);
+  if (record == nullptr) {
+    *size = 0;
+    return nullptr;
+  }
+  return session_reserve(record->s, sid, size);
+}
+
+int udp_server::commit(int conv, int sid, int size) {
+  auto *record = sessions_.find((uint32_t)conv);
+  return record == nullptr ? -1 : session_commit(record->s, sid, size);
+}
+
+void udp_server::set_priority(int conv, int sid, int cls) {
+  auto *record = sessions_.find((uint32_t)conv);
+  if (record != nullptr) {
+    session_priority(record->s, sid, cls);
   }
-  segment_->size = size;
-  memcpy(segment_->data, buffer, size);
-  return ikcp_send(kcp, (const char *)segment_, size + SessionHeaderSize);
 }
@@ -23,22 +23,120 @@
 #ifndef KCPSS_UDP_H
 #define KCPSS_UDP_H
 
+#include <deque>
+
 #include "public.h"
 #include "Reactor.h"
 #include "socket.h"
+#include "frame.h"
+#include "expiry.h"
+#include "siphash.h"
+#include "session_table.h"
+#include "priority.h"
+
+/**
+ * Control datagrams share the first 5 bytes (conv, cmd) with kcp segments but use
+ * commands kcp never emits, so they are told apart before ikcp_input.
+ * CMD_DATAGRAM is followed by a DATAGRAM frame, size holds the frame size.
+ */
+struct ControlHeader {
+  uint32_t conv;
+  uint8_t  cmd;
+  uint8_t  reserved[3];
+  uint32_t size;
+};
+constexpr int     ControlHeaderSize = sizeof(ControlHeader);
+constexpr uint8_t CMD_PROBE         = 0x60;
+constexpr uint8_t CMD_PROBE_ACK     = 0x61;
+constexpr uint8_t CMD_DATAGRAM      = 0x62;
+
+/** Packetization layer path mtu discovery state, see RFC 4821. */
+struct pmtu {
+  int      lo{0};          // largest size confirmed by the peer
+  int      hi{0};          // smallest size known to fail, minus one
+  int      size{0};        // size of the probe in flight, 0 if idle
+  int      tries{0};       // probes sent for the current size
+  uint32_t deadline{0};    // ack timeout, or time of the next search when idle
+  bool     verify{false};  // probe the size in use first, the path may have shrunk
+  int      refused{0};     // sends refused with EMSGSIZE in a row
+};
+
+/** Token bucket in bytes, refilled at rate bytes per second up to burst, may go into debt. */
+struct token_bucket {
+  double   rate{0};  // 0 means unlimited
+  double   burst{0};
+  double   tokens{0};
+  uint32_t stamp{0};
 
-struct SessionHeader {
-  int           sid;
-  int           size;
-  unsigned char data[];
+  bool limited() const { return rate > 0; }
+  void reset(double bytes_per_second, double size, uint32_t now) {
+    rate   = bytes_per_second;
+    burst  = size;
+    tokens = size;
+    stamp  = now;
+  }
+  void refill(uint32_t now) {
+    tokens = std::min(burst, tokens + rate * (uint32_t)(now - stamp) / 1000.0);
+    stamp  = now;
+  }
+  void consume(int bytes) { tokens -= bytes; }
+};
+
+/** A datagram the socket buffer had no room for, tag included, sent once the socket is writable. */
+struct queued_datagram {
+  endpoint                   target;
+  std::vector<unsigned char> bytes;
+};
+
+/** Receive side of the frame decoder, frames span kcp messages in stream mode or when the
+ *  peer cut its queued segments to a smaller mtu. */
+struct frame_reader {
+  frame_header               header{};
+  uint32_t                   remaining{0};  // Payload of a split data frame still to come
+  std::vector<unsigned char> carry;         // A split frame header or control frame
+};
+
+struct session {
+  explicit session(ikcpcb *kcp) : kcp(kcp) {}
+
+  ikcpcb *                   kcp;
+  pmtu                       mtu;
+  frame_reader               reader;
+  uint32_t                   pending_since{0};  // First frame of the open kcp segment
+  int                        reserved_head{0};  // Header room left by the last reserve
+  bool                       dirty{false};  // Queued for the end of loop flush
+  uint32_t                   last_active{0};    // Last datagram from the peer
+  uint32_t                   keepalive_at{0};   // Last keepalive probe
+  int                        keepalive_tries{0};
+
+  frame_scheduler                  scheduler;  // Frames waiting for room in the kcp window
+  std::unordered_map<int, uint8_t> classes;    // Priority class by sid, DEFAULT_CLASS if absent
+
+  token_bucket bucket;      // Rate limit of the session
+  double       deficit{0};  // Uplink share left, deficit round robin between sessions
 };
-constexpr int SessionHeaderSize = sizeof(SessionHeader);
 
 class udp {
 public:
-  using SessionCallbck         = std::function<int(int, int, unsigned char *buffer, int size)>;
-  const static int MTU         = 1376;  // The mss of default kcp
-  const static int MAX_PAYLOAD = MTU - sizeof(SessionHeader);
+  using SessionCallbck =
+    std::function<int(int conv, int sid, frame_type type, unsigned char *buffer, int size)>;
+  // Frame payloads point into kcp segments which are released once this returns
+  using FlushCallbck = std::function<int(int conv, bool more)>;
+  const static int DEFAULT_MTU    = 1400;    // The mtu of default kcp
+  const static int MIN_MTU        = 576;     // Every IPv4 host must accept this
+  const static int MAX_MTU        = 65507;   // The largest udp payload
+  const static int PROBE_STEP     = 16;      // Stop searching when the window is this small
+  const static int PROBE_TRIES    = 3;       // A size is given up after this many lost probes
+  const static int PROBE_TIMEOUT  = 200;     // ms, lower bound of the wait for a probe ack
+  const static int PROBE_INTERVAL = 600000;  // ms, a converged search restarts after this
+  const static int MAX_DELAY      = 10;      // ms, upper bound of the coalescing delay
+  const static int TICK_INTERVAL  = 1;       // ms, kcp update interval of all sessions
+  const static int RECV_BATCH     = 64;      // kcp segments delivered per flush callback
+  const static int READ_BATCH     = 64;      // datagrams one read callback takes at most
+  const static int SEND_DEPTH     = 64;      // kcp segments queued per flush at most
+  const static int WINDOW         = 4096;    // kcp send and receive window, in segments
+  const static int RATE_BURST     = 50;      // ms of traffic a token bucket holds
+  const static int SEND_QUEUE     = 8192;    // datagrams held while the socket buffer is full
 
 public:
   udp(Reactor *reactor, const char *addr, const char *remote_addr = nullptr);
@@ -47,41 +145,138 @@ public:
   int fd() const { return fd_; }
 
   void set_session_callback(SessionCallbck &cb);
+  void set_flush_callback(FlushCallbck &cb);
+  void set_max_mtu(int mtu);
+  void set_coalesce(bool coalesce, int delay = 0);
+  void set_stream(bool stream);
+  // Shared by client and server, datagrams tagged with another secret are dropped
+  void set_secret(const std::string &secret);
+  // Probes a session silent for half of nat_timeout seconds, 0 disables keepalive
+  void set_keepalive(int nat_timeout);
+  void set_priority_policy(const frame_scheduler::config &config);
+  // Class of the stream, carried to the peer by its OPEN, a negative class forgets it
+  virtual void set_priority(int conv, int sid, int cls);
 
-  virtual int send(int conv, int sid, unsigned char *buffer, int size);
+  virtual int send(int conv, int sid, frame_type type, unsigned char *buffer, int size);
   virtual int write(int conv, unsigned char *buffer, int size);
+  // Unreliable lane, the frame goes out in a datagram of its own right away, never retransmitted
+  int send_datagram(int conv, int sid, unsigned char *buffer, int size);
+
+  // Zero copy DATA frames: reserve returns room for a payload inside the kcp segment being
+  // filled, or nullptr, the caller writes up to *size bytes there and commits what it wrote
+  virtual unsigned char *reserve(int conv, int sid, int *size);
+  virtual int            commit(int conv, int sid, int size);
 
 protected:
-  ikcpcb *crtete_kcp(int conv);
+  session *   crtete_kcp(int conv);
+  virtual int on_tick();
+  void        update(session *s, uint32_t now);
+  void        keepalive(session *s, uint32_t now);
+  int      session_send(session *s, int sid, frame_type type, unsigned char *buffer, int size);
+  int      write_frame(session *s, int sid, frame_type type, unsigned char *buffer, int size);
+  unsigned char *session_reserve(session *s, int sid, int *size);
+  int            session_commit(session *s, int sid, int size);
+  int            queue(session *s);
+  int            flush(session *s);
+  int            flush_pending();
+
+  // Priority classes
+  void session_priority(session *s, int sid, int cls);
+  bool scheduling(session *s) const;
+  void drain(session *s);
+
+  // Path mtu discovery
+  void        reset_probe(session *s);
+  void        probe_mtu(session *s, uint32_t now);
+  int         base_mtu() const;
+  void        fall_back(session *s, const char *reason);
+  void        sent(session *s, int error);
+  int         write_control(int conv, uint8_t cmd, uint32_t value, int size);
+  static bool is_control(const unsigned char *buffer, int size);
+  void        on_control(session *s, unsigned char *buffer, int size);
 
   int          read_socket();
-  virtual void on_read(unsigned char *buffer, int size, sockaddr_in *target);
+  void         on_datagram(unsigned char *buffer, int size, const struct sockaddr *from,
+                           socklen_t len);
+  bool         verify(unsigned char *buffer, int *size);
+  int          write_to(const endpoint &target, unsigned char *buffer, int size);
+  bool         send_blocked() const { return !send_queue_.empty(); }
+  int          defer(const endpoint &target, unsigned char *buffer, int size,
+                     const unsigned char *tag);
+  int          send_queued();
+  void         on_send_error(int error, unsigned char *buffer, int size,
+                             const struct sockaddr *to, socklen_t len);
+  virtual session *owner(uint32_t conv) { return session_; }
+  void         watch(bool writable);
+  virtual void on_read(unsigned char *buffer, int size, const endpoint &from);
+  void         on_session_read(session *s, unsigned char *buffer, int size);
+  void         on_message(session *s, unsigned char *buffer, int size);
+  void         on_frame(session *s, const frame_header &header, unsigned char *buffer, int size);
 
 protected:
   Reactor *       reactor_;
   int             fd_;
-  ikcpcb *        kcp_;
-  endpoint *      target_;
+  int             family_;
+  session *       session_;
+  endpoint        target_;
   SessionCallbck *cb_;
-  SessionHeader * segment_;
+  FlushCallbck    flush_cb_;
   unsigned char * recv_bufffer_;
+  unsigned char * probe_buffer_;
+  unsigned char * datagram_buffer_;
+  int             max_mtu_;
+  bool            coalesce_;
+  int             coalesce_delay_;
+  bool            stream_;
+  uint32_t        keepalive_;  // ms of silence before a keepalive probe, 0 disables it
+  siphash         tag_;
+
+  Reactor::TimerWatcher  tick_;   // kcp updates of every session
+  Reactor::PrepareHandle flush_;  // End of loop flush of coalesced frames
+
+  frame_scheduler::config priority_;
+  std::vector<session *>  dirty_;  // Sessions with pending frames
+
+  std::deque<queued_datagram> send_queue_;  // In order, new datagrams wait behind queued ones
+  bool                        watching_{false};  // Waiting for EV_WRITE
+  bool                        direct_{false};    // Bypass the reactor, send with sendmsg now
+  bool                        ringed_{false};    // Last send went to the ring, errors come later
 };
 
 class udp_server : public udp {
 public:
+  using ReleaseCallback = std::function<int(int conv)>;
   using udp::udp;
 
-  int write(int conv, unsigned char *buffer, int size) override;
-  int send(int conv, int sid, unsigned char *buffer, int size) override;
+  int            write(int conv, unsigned char *buffer, int size) override;
+  int            send(int conv, int sid, frame_type type, unsigned char *buffer, int size) override;
+  unsigned char *reserve(int conv, int sid, int *size) override;
+  int            commit(int conv, int sid, int size) override;
+  void           set_priority(int conv, int sid, int cls) override;
+
+  // Sessions without any datagram for this long are released, 0 keeps them forever
+  void set_idle_timeout(int seconds);
+  // KiB/s each session and all of them together may send, 0 for no limit
+  void set_rate_limit(int session_rate, int uplink_rate);
+  void set_release_callback(ReleaseCallback &cb);
 
 protected:
-  void on_read(unsigned char *buffer, int size, sockaddr_in *target) override;
-  bool connected_client(int conv);
+  void     on_read(unsigned char *buffer, int size, const endpoint &from) override;
+  int      on_tick() override;
+  session *owner(uint32_t conv) override;
+  void shape(session *s, uint32_t now);
+  void release(uint32_t conv);
 
 private:
-  std::unordered_map<endpoint, ikcpcb *> client_conv_;
-  std::unordered_map<int, endpoint>      conv_ep_;
-  std::unordered_map<int, ikcpcb *>      conv_kcp_;
+  session_table          sessions_;
+  ReleaseCallback        release_cb_;
+  uint32_t               idle_timeout_{0};
+  expiry_wheel<uint32_t> expiry_;
+
+  double       session_rate_{0};  // bytes per second, 0 for no limit
+  token_bucket uplink_;
+  double       quantum_{0};  // Uplink bytes a backlogged session is credited per tick
+  size_t       cursor_{0};   // Where the next tick starts visiting sessions
 };
 
 #endif  // KCPSS_UDP_H